@@ -0,0 +1,724 @@
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+#include <GLFW/glfw3.h>
+
+#include "objtest.h"
+
+/*
+ * Bounding volume hierarchy for ray queries against a Model.
+ *
+ * Construction happens in two steps. First a binary BVH is built top-down with binned SAH,
+ * with large subtrees handed to their own threads. Then the binary tree is collapsed into
+ * BVH_WIDTH-ary nodes so traversal can test all children of a node with one SIMD slab test.
+ */
+
+/* Magic Numbers */
+#define SAH_TRAVERSAL_COST 1.0f // relative to the cost of one ray/triangle test
+#define TRI_FLOATS 9 // v0, e1, e2
+#define RAY_EPSILON 1e-7f
+
+// Binary node used during construction
+typedef struct build_node
+{
+    float bmin[3], bmax[3];
+    int left, right; // child node indices, -1 for leaves
+    int first, count; // range in the primitive index array
+} Build_Node;
+
+// Shared state for a BVH build
+typedef struct build_context
+{
+    // Per triangle bounds and centroids
+    float* tri_min;
+    float* tri_max;
+    float* centroid;
+
+    int* prims; // triangle indices, partitioned in place as the tree is built
+
+    Build_Node* nodes;
+    int node_count; // incremented atomically as subtrees are built in parallel
+    int spawn_depth; // subtrees above this depth may be built on their own thread
+    int threads_spawned; // incremented atomically, not counting the calling thread
+
+    // Wide nodes are created after the binary build is done
+    BVH_Node* wide_nodes;
+    int wide_count;
+} Build_Context;
+
+// Arguments for building a subtree on another thread
+typedef struct build_task
+{
+    Build_Context* ctx;
+    int node, first, count, depth;
+} Build_Task;
+
+static void build_recursive(Build_Context* ctx, int node, int first, int count, int depth);
+static void split_node(Build_Context* ctx, int node, int first, int count, int mid, int depth);
+
+static float surface_area(const float* bmin, const float* bmax)
+{
+    float dx = bmax[0]-bmin[0], dy = bmax[1]-bmin[1], dz = bmax[2]-bmin[2];
+    if (dx < 0 || dy < 0 || dz < 0) { return 0.0f; }
+    return 2.0f * (dx*dy + dy*dz + dz*dx);
+}
+
+static void grow(float* bmin, float* bmax, const float* pmin, const float* pmax)
+{
+    for (int a = 0; a < 3; a++)
+    {
+        if (pmin[a] < bmin[a]) { bmin[a] = pmin[a]; }
+        if (pmax[a] > bmax[a]) { bmax[a] = pmax[a]; }
+    }
+}
+
+static void empty_bounds(float* bmin, float* bmax)
+{
+    bmin[0] = bmin[1] = bmin[2] = FLT_MAX;
+    bmax[0] = bmax[1] = bmax[2] = -FLT_MAX;
+}
+
+// Bin of a centroid coordinate. Out of range and NaN coordinates land in the end bins.
+static int bin_of(float c, float cmin, float scale)
+{
+    float f = (c - cmin) * scale;
+
+    if (!(f > 0.0f)) { return 0; }
+    if (f >= BVH_BINS) { return BVH_BINS-1; }
+    return (int) f;
+}
+
+// Centroid coordinate used to order triangles, NaN last
+static float centroid_key(Build_Context* ctx, int p, int axis)
+{
+    float c = ctx->centroid[p*3+axis];
+    return isnan(c) ? INFINITY : c;
+}
+
+// Splits [first, first+count) at its middle index so the lower half holds the triangles with
+// the smaller centroids along axis (quickselect), returning the middle. Used when SAH can't
+// split a node.
+static int median_split(Build_Context* ctx, int first, int count, int axis)
+{
+    int mid = first + count/2;
+    int lo = first, hi = first+count-1;
+
+    while (lo < hi)
+    {
+        float pivot = centroid_key(ctx, ctx->prims[lo + (hi-lo)/2], axis);
+        int i = lo, j = hi;
+
+        while (i <= j)
+        {
+            while (centroid_key(ctx, ctx->prims[i], axis) < pivot) { i++; }
+            while (centroid_key(ctx, ctx->prims[j], axis) > pivot) { j--; }
+            if (i <= j) { int p = ctx->prims[i]; ctx->prims[i] = ctx->prims[j]; ctx->prims[j] = p; i++; j--; }
+        }
+
+        if (mid <= j) { hi = j; }
+        else if (mid >= i) { lo = i; }
+        else { break; }
+    }
+
+    return mid;
+}
+
+// Axis along which the centroid bounds are widest
+static int widest_axis(const float* cmin, const float* cmax)
+{
+    int axis = 0;
+    for (int a = 1; a < 3; a++) { if (cmax[a]-cmin[a] > cmax[axis]-cmin[axis]) { axis = a; } }
+    return axis;
+}
+
+static void* build_thread(void* arg)
+{
+    Build_Task* task = (Build_Task*) arg;
+    build_recursive(task->ctx, task->node, task->first, task->count, task->depth);
+    return NULL;
+}
+
+// Creates node's children from the ranges either side of mid and builds them
+static void split_node(Build_Context* ctx, int node, int first, int count, int mid, int depth)
+{
+    Build_Node* n = &ctx->nodes[node];
+
+    // Reserve both children at once so siblings are adjacent
+    int left = __sync_fetch_and_add(&ctx->node_count, 2);
+    n->left = left;
+    n->right = left+1;
+
+    // Build large subtrees near the root in parallel. Ranges of the primitive array and
+    // the node slots are disjoint between subtrees so no further locking is needed.
+    if (depth < ctx->spawn_depth && count >= BVH_PARALLEL_MIN)
+    {
+        pthread_t thread;
+        Build_Task task = { ctx, left, first, mid-first, depth+1 };
+
+        if (pthread_create(&thread, NULL, build_thread, &task) == 0)
+        {
+            __sync_fetch_and_add(&ctx->threads_spawned, 1);
+            build_recursive(ctx, left+1, mid, first+count-mid, depth+1);
+            pthread_join(thread, NULL);
+            return;
+        }
+    }
+
+    build_recursive(ctx, left, first, mid-first, depth+1);
+    build_recursive(ctx, left+1, mid, first+count-mid, depth+1);
+}
+
+static void build_recursive(Build_Context* ctx, int node, int first, int count, int depth)
+{
+    Build_Node* n = &ctx->nodes[node];
+    float cmin[3], cmax[3]; // centroid bounds
+
+    // Bounds of the node and of its triangles' centroids
+    empty_bounds(n->bmin, n->bmax);
+    empty_bounds(cmin, cmax);
+    for (int i = first; i < first+count; i++)
+    {
+        int p = ctx->prims[i];
+        grow(n->bmin, n->bmax, &ctx->tri_min[p*3], &ctx->tri_max[p*3]);
+        grow(cmin, cmax, &ctx->centroid[p*3], &ctx->centroid[p*3]);
+    }
+
+    n->left = n->right = -1;
+    n->first = first;
+    n->count = count;
+
+    if (count <= BVH_LEAF_SIZE) { return; }
+
+    // Past the maximum depth only median splits are made, which halve the node each level
+    if (depth >= BVH_MAX_DEPTH)
+    {
+        split_node(ctx, node, first, count, median_split(ctx, first, count, widest_axis(cmin, cmax)), depth);
+        return;
+    }
+
+    /* Binned SAH split */
+
+    float best_cost = FLT_MAX;
+    int best_axis = -1, best_split = 0;
+
+    for (int a = 0; a < 3; a++)
+    {
+        // Flat, overflowing (coordinates near FLT_MAX) and NaN extents can't be binned
+        float extent = cmax[a] - cmin[a];
+        float scale = BVH_BINS / extent;
+        if (!(extent > 0.0f) || !isfinite(extent) || !isfinite(scale)) { continue; }
+
+        int bin_count[BVH_BINS] = { 0 };
+        float bin_min[BVH_BINS][3], bin_max[BVH_BINS][3];
+        for (int b = 0; b < BVH_BINS; b++) { empty_bounds(bin_min[b], bin_max[b]); }
+
+        for (int i = first; i < first+count; i++)
+        {
+            int p = ctx->prims[i];
+            int b = bin_of(ctx->centroid[p*3+a], cmin[a], scale);
+            bin_count[b]++;
+            grow(bin_min[b], bin_max[b], &ctx->tri_min[p*3], &ctx->tri_max[p*3]);
+        }
+
+        // Sweep from the right to get the cost of everything right of each split plane,
+        // then sweep from the left and combine.
+        float right_area[BVH_BINS];
+        int right_count[BVH_BINS];
+        float rmin[3], rmax[3];
+        int rcount = 0;
+        empty_bounds(rmin, rmax);
+        for (int b = BVH_BINS-1; b > 0; b--)
+        {
+            grow(rmin, rmax, bin_min[b], bin_max[b]);
+            rcount += bin_count[b];
+            right_area[b] = surface_area(rmin, rmax);
+            right_count[b] = rcount;
+        }
+
+        float lmin[3], lmax[3];
+        int lcount = 0;
+        empty_bounds(lmin, lmax);
+        for (int b = 0; b < BVH_BINS-1; b++)
+        {
+            grow(lmin, lmax, bin_min[b], bin_max[b]);
+            lcount += bin_count[b];
+            if (lcount == 0 || right_count[b+1] == 0) { continue; }
+
+            float cost = surface_area(lmin, lmax)*lcount + right_area[b+1]*right_count[b+1];
+            if (cost < best_cost) { best_cost = cost; best_axis = a; best_split = b+1; }
+        }
+    }
+
+    // Partition the triangles around the chosen plane. If every centroid lands in the same
+    // bin (or they all coincide, or no axis could be binned) fall back to a median split
+    // along the widest axis.
+    int mid = first + count/2;
+    if (best_axis < 0) { mid = median_split(ctx, first, count, widest_axis(cmin, cmax)); }
+    else
+    {
+        float leaf_cost = count;
+        float split_cost = SAH_TRAVERSAL_COST + best_cost / surface_area(n->bmin, n->bmax);
+
+        // Small nodes that are cheaper to test as a whole stay leaves
+        if (split_cost >= leaf_cost && count <= BVH_LEAF_SIZE*2) { return; }
+
+        float scale = BVH_BINS / (cmax[best_axis] - cmin[best_axis]);
+        int i = first, j = first+count-1;
+        while (i <= j)
+        {
+            int p = ctx->prims[i];
+            int b = bin_of(ctx->centroid[p*3+best_axis], cmin[best_axis], scale);
+
+            if (b < best_split) { i++; }
+            else { ctx->prims[i] = ctx->prims[j]; ctx->prims[j] = p; j--; }
+        }
+        mid = i;
+    }
+
+    split_node(ctx, node, first, count, mid, depth);
+}
+
+// Writes one child slot of a wide node
+static void set_child(BVH_Node* wide, int slot, const float* bmin, const float* bmax,
+                      int child, int count)
+{
+    wide->min_x[slot] = bmin[0]; wide->min_y[slot] = bmin[1]; wide->min_z[slot] = bmin[2];
+    wide->max_x[slot] = bmax[0]; wide->max_y[slot] = bmax[1]; wide->max_z[slot] = bmax[2];
+    wide->child[slot] = child;
+    wide->count[slot] = count;
+}
+
+// Collapses the binary subtree under node into wide nodes, returning the wide node index
+static int collapse(Build_Context* ctx, int node)
+{
+    int index = ctx->wide_count++;
+    int children[BVH_WIDTH];
+    int child_count = 2;
+
+    children[0] = ctx->nodes[node].left;
+    children[1] = ctx->nodes[node].right;
+
+    // Pull grandchildren up until the node is full, opening the largest inner child first
+    while (child_count < BVH_WIDTH)
+    {
+        int best = -1;
+        float best_area = -1.0f;
+        for (int i = 0; i < child_count; i++)
+        {
+            Build_Node* c = &ctx->nodes[children[i]];
+            if (c->left < 0) { continue; }
+
+            float area = surface_area(c->bmin, c->bmax);
+            if (area > best_area) { best_area = area; best = i; }
+        }
+        if (best < 0) { break; }
+
+        Build_Node* opened = &ctx->nodes[children[best]];
+        children[best] = opened->left;
+        children[child_count++] = opened->right;
+    }
+
+    // Fill the slots. ctx->wide_nodes is not reallocated so the pointer stays valid.
+    BVH_Node* wide = &ctx->wide_nodes[index];
+    for (int i = 0; i < BVH_WIDTH; i++)
+    {
+        float bmin[3], bmax[3];
+        empty_bounds(bmin, bmax);
+        set_child(wide, i, bmin, bmax, -1, -1);
+    }
+
+    for (int i = 0; i < child_count; i++)
+    {
+        Build_Node* c = &ctx->nodes[children[i]];
+        if (c->left < 0)
+        { set_child(wide, i, c->bmin, c->bmax, c->first, c->count); }
+        else
+        { set_child(wide, i, c->bmin, c->bmax, collapse(ctx, children[i]), 0); }
+    }
+
+    return index;
+}
+
+BVH* build_bvh(Model* model)
+{
+    /* Variables */
+
+    Build_Context ctx;
+    BVH* bvh = NULL;
+    int tri_count = model->tri_count;
+    double start = get_time();
+
+    // error check
+    if (tri_count <= 0) { fprintf(stderr, "Cannot build a BVH without triangles.\n"); return NULL; }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.tri_min = (float*) calloc(tri_count*3, sizeof(float));
+    ctx.tri_max = (float*) calloc(tri_count*3, sizeof(float));
+    ctx.centroid = (float*) calloc(tri_count*3, sizeof(float));
+    ctx.prims = (int*) calloc(tri_count, sizeof(int));
+    ctx.nodes = (Build_Node*) calloc(tri_count*2, sizeof(Build_Node)); // binary tree bound
+
+    if (!ctx.tri_min || !ctx.tri_max || !ctx.centroid || !ctx.prims || !ctx.nodes)
+    { fprintf(stderr, "Out of memory building BVH.\n"); return NULL; }
+
+    // Allow roughly one thread per CPU: each level below the root doubles the thread count
+    ctx.spawn_depth = 0;
+    while ((1 << ctx.spawn_depth) < cpu_count()) { ctx.spawn_depth++; }
+
+    /* Triangle bounds */
+
+    for (int i = 0; i < tri_count; i++)
+    {
+        Triangle* t = model->triangles[i];
+        float p[3][3] = { { t->v1->x, t->v1->y, t->v1->z },
+                          { t->v2->x, t->v2->y, t->v2->z },
+                          { t->v3->x, t->v3->y, t->v3->z } };
+
+        empty_bounds(&ctx.tri_min[i*3], &ctx.tri_max[i*3]);
+        for (int k = 0; k < 3; k++) { grow(&ctx.tri_min[i*3], &ctx.tri_max[i*3], p[k], p[k]); }
+        for (int a = 0; a < 3; a++)
+        { ctx.centroid[i*3+a] = 0.5f * (ctx.tri_min[i*3+a] + ctx.tri_max[i*3+a]); }
+
+        ctx.prims[i] = i;
+    }
+
+    /* Binary build */
+
+    ctx.node_count = 1;
+    build_recursive(&ctx, 0, 0, tri_count, 0);
+
+    /* Collapse into wide nodes */
+
+    ctx.wide_nodes = (BVH_Node*) calloc(ctx.node_count, sizeof(BVH_Node));
+    if (ctx.nodes[0].left < 0)
+    {
+        // The whole model fits in one leaf, wrap it in a root node
+        float bmin[3], bmax[3];
+        ctx.wide_count = 1;
+        empty_bounds(bmin, bmax);
+        for (int i = 0; i < BVH_WIDTH; i++) { set_child(&ctx.wide_nodes[0], i, bmin, bmax, -1, -1); }
+        set_child(&ctx.wide_nodes[0], 0, ctx.nodes[0].bmin, ctx.nodes[0].bmax, 0, tri_count);
+    }
+    else { collapse(&ctx, 0); }
+
+    /* Create BVH object for return */
+
+    bvh = (BVH*) calloc(1, sizeof(BVH));
+    bvh->node_count = ctx.wide_count;
+    bvh->nodes = (BVH_Node*) realloc(ctx.wide_nodes, ctx.wide_count*sizeof(BVH_Node));
+    bvh->tri_count = tri_count;
+    bvh->tri_index = ctx.prims;
+    bvh->tri_data = (float*) calloc(tri_count*TRI_FLOATS, sizeof(float));
+
+    bvh->bounds_min.x = ctx.nodes[0].bmin[0];
+    bvh->bounds_min.y = ctx.nodes[0].bmin[1];
+    bvh->bounds_min.z = ctx.nodes[0].bmin[2];
+    bvh->bounds_max.x = ctx.nodes[0].bmax[0];
+    bvh->bounds_max.y = ctx.nodes[0].bmax[1];
+    bvh->bounds_max.z = ctx.nodes[0].bmax[2];
+
+    // Store triangles in leaf order so a leaf's triangles are contiguous in memory
+    for (int i = 0; i < tri_count; i++)
+    {
+        Triangle* t = model->triangles[bvh->tri_index[i]];
+        float* d = &bvh->tri_data[i*TRI_FLOATS];
+
+        d[0] = t->v1->x; d[1] = t->v1->y; d[2] = t->v1->z;
+        d[3] = t->v2->x - t->v1->x; d[4] = t->v2->y - t->v1->y; d[5] = t->v2->z - t->v1->z;
+        d[6] = t->v3->x - t->v1->x; d[7] = t->v3->y - t->v1->y; d[8] = t->v3->z - t->v1->z;
+    }
+
+    bvh->build_time = get_time() - start;
+    bvh->build_threads = 1 + ctx.threads_spawned;
+
+    /* Garbage Collection */
+
+    free(ctx.tri_min); ctx.tri_min = NULL;
+    free(ctx.tri_max); ctx.tri_max = NULL;
+    free(ctx.centroid); ctx.centroid = NULL;
+    free(ctx.nodes); ctx.nodes = NULL;
+
+    return bvh;
+}
+
+void free_bvh(BVH* bvh)
+{
+    if (!bvh) { return; }
+
+    free(bvh->nodes);
+    free(bvh->tri_index);
+    free(bvh->tri_data);
+    free(bvh);
+}
+
+size_t bvh_bytes(BVH* bvh)
+{
+    if (!bvh) { return 0; }
+
+    return sizeof(BVH) + bvh->node_count*sizeof(BVH_Node) +
+           bvh->tri_count*(sizeof(int) + TRI_FLOATS*sizeof(float));
+}
+
+void init_ray(Ray* ray, Vector3f origin, Vector3f dir, float tmax)
+{
+    ray->origin = origin;
+    ray->dir = dir;
+
+    // Division by zero gives infinity, which the slab test handles
+    ray->inv_dir.x = 1.0f / dir.x;
+    ray->inv_dir.y = 1.0f / dir.y;
+    ray->inv_dir.z = 1.0f / dir.z;
+
+    ray->tmin = 0.0f;
+    ray->tmax = tmax;
+}
+
+// Slab test of a ray against all children of a node. Returns a bitmask of the children hit
+// and writes their entry distances to tnear.
+static int intersect_node(const BVH_Node* node, const Ray* ray, float tmax, float* tnear)
+{
+    int mask = 0;
+
+#ifdef __SSE__
+    __m128 ox = _mm_set1_ps(ray->origin.x), ix = _mm_set1_ps(ray->inv_dir.x);
+    __m128 oy = _mm_set1_ps(ray->origin.y), iy = _mm_set1_ps(ray->inv_dir.y);
+    __m128 oz = _mm_set1_ps(ray->origin.z), iz = _mm_set1_ps(ray->inv_dir.z);
+
+    __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node->min_x), ox), ix);
+    __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node->max_x), ox), ix);
+    __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node->min_y), oy), iy);
+    __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node->max_y), oy), iy);
+    __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node->min_z), oz), iz);
+    __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node->max_z), oz), iz);
+
+    __m128 enter = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+                              _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_set1_ps(ray->tmin)));
+    __m128 leave = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+                             _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(tmax)));
+
+    _mm_storeu_ps(tnear, enter);
+    mask = _mm_movemask_ps(_mm_cmple_ps(enter, leave));
+#else
+    // Same slab test as above, one child at a time
+    for (int i = 0; i < BVH_WIDTH; i++)
+    {
+        float t0x = (node->min_x[i] - ray->origin.x) * ray->inv_dir.x;
+        float t1x = (node->max_x[i] - ray->origin.x) * ray->inv_dir.x;
+        float t0y = (node->min_y[i] - ray->origin.y) * ray->inv_dir.y;
+        float t1y = (node->max_y[i] - ray->origin.y) * ray->inv_dir.y;
+        float t0z = (node->min_z[i] - ray->origin.z) * ray->inv_dir.z;
+        float t1z = (node->max_z[i] - ray->origin.z) * ray->inv_dir.z;
+
+        float enter = fmaxf(fmaxf(fminf(t0x, t1x), fminf(t0y, t1y)),
+                            fmaxf(fminf(t0z, t1z), ray->tmin));
+        float leave = fminf(fminf(fmaxf(t0x, t1x), fmaxf(t0y, t1y)),
+                           fminf(fmaxf(t0z, t1z), tmax));
+
+        tnear[i] = enter;
+        if (enter <= leave) { mask |= 1 << i; }
+    }
+#endif
+
+    // Empty slots have inverted bounds, but an infinite inverse direction can still make
+    // them pass the slab test, so mask them out explicitly
+    for (int i = 0; i < BVH_WIDTH; i++)
+    { if (node->count[i] < 0) { mask &= ~(1 << i); } }
+
+    return mask;
+}
+
+// Moller-Trumbore ray/triangle test against a triangle stored as v0, e1, e2.
+// Returns the distance along the ray, or a negative number on a miss.
+static float intersect_tri(const float* d, const Ray* ray, float tmax, float* u_out, float* v_out)
+{
+    const Vector3f* o = &ray->origin;
+    const Vector3f* r = &ray->dir;
+
+    // pvec = dir x e2
+    float px = r->y*d[8] - r->z*d[7];
+    float py = r->z*d[6] - r->x*d[8];
+    float pz = r->x*d[7] - r->y*d[6];
+
+    float det = d[3]*px + d[4]*py + d[5]*pz;
+    if (fabsf(det) < RAY_EPSILON) { return -1.0f; } // parallel to the triangle
+    float inv_det = 1.0f / det;
+
+    float tx = o->x - d[0], ty = o->y - d[1], tz = o->z - d[2];
+    float u = (tx*px + ty*py + tz*pz) * inv_det;
+    if (u < 0.0f || u > 1.0f) { return -1.0f; }
+
+    // qvec = tvec x e1
+    float qx = ty*d[5] - tz*d[4];
+    float qy = tz*d[3] - tx*d[5];
+    float qz = tx*d[4] - ty*d[3];
+
+    float v = (r->x*qx + r->y*qy + r->z*qz) * inv_det;
+    if (v < 0.0f || u+v > 1.0f) { return -1.0f; }
+
+    float t = (d[6]*qx + d[7]*qy + d[8]*qz) * inv_det;
+    if (t < ray->tmin || t > tmax) { return -1.0f; }
+
+    *u_out = u;
+    *v_out = v;
+    return t;
+}
+
+// Shared traversal for both query types. any_hit returns on the first intersection found.
+static bool traverse(BVH* bvh, Ray* ray, Hit* hit, bool any_hit)
+{
+    int stack[BVH_STACK_SIZE];
+    int sp = 0;
+    float closest = ray->tmax;
+    bool found = FALSE;
+
+    if (!bvh) { return FALSE; }
+    stack[sp++] = 0;
+
+    while (sp > 0)
+    {
+        const BVH_Node* node = &bvh->nodes[stack[--sp]];
+        float tnear[BVH_WIDTH];
+        int mask = intersect_node(node, ray, closest, tnear);
+
+        // Inner children that were hit, to be pushed far to near
+        int order[BVH_WIDTH];
+        int inner = 0;
+
+        for (int i = 0; i < BVH_WIDTH; i++)
+        {
+            if (!(mask & (1 << i))) { continue; }
+
+            // Leaves are tested right away
+            if (node->count[i] > 0)
+            {
+                for (int k = node->child[i]; k < node->child[i]+node->count[i]; k++)
+                {
+                    float u, v;
+                    float t = intersect_tri(&bvh->tri_data[k*TRI_FLOATS], ray, closest, &u, &v);
+                    if (t < 0.0f) { continue; }
+
+                    found = TRUE;
+                    closest = t;
+                    if (hit)
+                    {
+                        hit->tri_index = bvh->tri_index[k];
+                        hit->t = t;
+                        hit->u = u;
+                        hit->v = v;
+                    }
+                    if (any_hit) { return TRUE; }
+                }
+                continue;
+            }
+
+            // Insertion sort by distance, farthest first
+            int j = inner++;
+            while (j > 0 && tnear[order[j-1]] < tnear[i]) { order[j] = order[j-1]; j--; }
+            order[j] = i;
+        }
+
+        for (int i = 0; i < inner; i++)
+        {
+            // Can't fail since build_recursive bounds the depth, see BVH_MAX_DEPTH
+            assert(sp < BVH_STACK_SIZE);
+            stack[sp++] = node->child[order[i]];
+        }
+    }
+
+    return found;
+}
+
+bool bvh_closest_hit(BVH* bvh, Ray* ray, Hit* hit)
+{
+    return traverse(bvh, ray, hit, FALSE);
+}
+
+bool bvh_any_hit(BVH* bvh, Ray* ray)
+{
+    return traverse(bvh, ray, NULL, TRUE);
+}
+
+int bench_bvh(Model* model, int ray_count)
+{
+    /* Variables */
+
+    BVH* bvh = NULL;
+    Ray* rays = (Ray*) calloc(ray_count, sizeof(Ray));
+    Hit hit;
+    int hits = 0;
+    double start = 0, closest_time = 0, any_time = 0;
+
+    if (!rays) { fprintf(stderr, "Out of memory allocating rays.\n"); return ERR; }
+
+    /* Build */
+
+    bvh = build_bvh(model);
+    if (!bvh) { return ERR; }
+
+    printf("BVH: %d triangles, %d nodes, built in %.2f ms on %d threads\n",
+           bvh->tri_count, bvh->node_count, bvh->build_time*1000.0, bvh->build_threads);
+
+    /* Generate rays */
+
+    // Rays start on a sphere around the model and aim at random points inside its bounds.
+    // A fixed seed keeps runs comparable.
+    Vector3f lo = bvh->bounds_min, hi = bvh->bounds_max;
+    Vector3f center = { (lo.x+hi.x)*0.5f, (lo.y+hi.y)*0.5f, (lo.z+hi.z)*0.5f };
+    float radius = sqrtf((hi.x-lo.x)*(hi.x-lo.x) + (hi.y-lo.y)*(hi.y-lo.y) + (hi.z-lo.z)*(hi.z-lo.z));
+
+    srand(1);
+    for (int i = 0; i < ray_count; i++)
+    {
+        float r1 = (float) rand() / RAND_MAX, r2 = (float) rand() / RAND_MAX;
+        float z = 1.0f - 2.0f*r1, phi = 2.0f*M_PI*r2, s = sqrtf(1.0f - z*z);
+        Vector3f origin = { center.x + radius*s*cosf(phi),
+                            center.y + radius*s*sinf(phi),
+                            center.z + radius*z };
+        Vector3f target = { lo.x + (hi.x-lo.x) * rand() / RAND_MAX,
+                            lo.y + (hi.y-lo.y) * rand() / RAND_MAX,
+                            lo.z + (hi.z-lo.z) * rand() / RAND_MAX };
+        Vector3f dir = { target.x-origin.x, target.y-origin.y, target.z-origin.z };
+        float len = sqrtf(dir.x*dir.x + dir.y*dir.y + dir.z*dir.z);
+
+        if (len > 0) { dir.x /= len; dir.y /= len; dir.z /= len; }
+        init_ray(&rays[i], origin, dir, 2.0f*radius);
+    }
+
+    /* Trace */
+
+    start = get_time();
+    for (int i = 0; i < ray_count; i++) { if (bvh_closest_hit(bvh, &rays[i], &hit)) { hits++; } }
+    closest_time = get_time() - start;
+
+    printf("closest-hit: %d rays, %d hits, %.2f Mrays/s\n",
+           ray_count, hits, ray_count / closest_time / 1e6);
+
+    hits = 0;
+    start = get_time();
+    for (int i = 0; i < ray_count; i++) { if (bvh_any_hit(bvh, &rays[i])) { hits++; } }
+    any_time = get_time() - start;
+
+    printf("any-hit: %d rays, %d hits, %.2f Mrays/s\n",
+           ray_count, hits, ray_count / any_time / 1e6);
+
+    /* Garbage Collection */
+
+    free(rays); rays = NULL;
+    free_bvh(bvh); bvh = NULL;
+
+    return NOERR;
+}
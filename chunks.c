@@ -0,0 +1,830 @@
+#define _FILE_OFFSET_BITS 64 // chunk files can be larger than 2GB
+
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+#include <GLFW/glfw3.h>
+
+#include "objtest.h"
+
+/*
+ * Out-of-core models.
+ *
+ * preprocess_obj streams an OBJ file in bounded memory and writes a chunk file: the
+ * triangles sorted into a CHUNK_GRID^3 grid of spatial chunks, each stored contiguously as
+ * interleaved T2F_N3F_V3F vertices so it can be handed straight to OpenGL. Grid cells
+ * holding more than 1/CHUNK_FRACTION of the memory cap are split again until they don't.
+ * Cells are staged on disk as blocks, runs of triangles flushed from their write buffers.
+ * The cell and block tables get a fixed 1/META_FRACTION of the cap, and when the block table
+ * runs low each cell's blocks are merged into one.
+ *
+ * At render time page_chunks reads chunks in as they become visible and evicts the least
+ * recently used ones to stay under a memory budget.
+ *
+ * Chunk file layout (native endianness):
+ *   char magic[8], int chunk_count, int textured
+ *   per chunk: float bounds_min[3], float bounds_max[3], int tri_count, long long offset
+ *   triangle data
+ */
+
+/* Magic Numbers */
+#define CHUNK_MAGIC "OBJCHNK1"
+#define CHUNK_MAGIC_SIZE 8
+#define CHUNK_COUNT (CHUNK_GRID*CHUNK_GRID*CHUNK_GRID)
+#define TRI_FLOATS 24 // 3 vertices of u, v, nx, ny, nz, x, y, z
+#define TRI_BYTES (TRI_FLOATS*sizeof(float))
+#define LINE_SIZE 4096 // longest OBJ line accepted
+#define SPILL_PAGE_FLOATS 3072 // divisible by 2 and 3 so attributes never straddle pages
+#define MAX_FACE_VERTS 64 // polygons are fan triangulated, up to this many corners
+#define META_FRACTION 8 // share of the memory cap for the cell and block tables
+#define NO_BLOCK -1
+
+// Vertex attributes of one kind spilled to a temporary file during preprocessing, read back
+// through a small direct mapped page cache
+typedef struct spill
+{
+    FILE* file;
+    int stride; // floats per attribute
+    long count;
+
+    int slot_count;
+    long* tags; // page held by each slot, -1 for empty
+    float* pages;
+} Spill;
+
+// A run of triangles flushed from a cell's write buffer to the staging file
+typedef struct block
+{
+    long tri_count;
+    off_t offset;
+    long next; // next block of the same cell, or the next free block
+} Block;
+
+// A chunk while preprocessing
+typedef struct cell
+{
+    long tri_count;
+    float bounds[6]; // min xyz, max xyz of its triangles
+    bool split_by_order; // splitting in space made no progress, split into runs instead
+    long first_block, last_block; // its blocks in file order, NO_BLOCK if none
+} Cell;
+
+// Preprocessing state shared by the binning and splitting helpers
+typedef struct chunker
+{
+    FILE* staging; // write buffers are flushed here as blocks
+    int buffer_tris;
+    float* buffers; // CHUNK_COUNT write buffers of buffer_tris triangles
+    int* buffered; // triangles in each write buffer
+    float* read_buffer; // buffer_tris triangles, for reading blocks back in pieces
+
+    // Both tables are allocated once from the cap and never grow
+    Cell* cells;
+    int cell_count, cell_size;
+
+    Block* blocks;
+    long block_size;
+    long free_block, free_count; // unused blocks, chained through next
+    long blocks_written;
+} Chunker;
+
+static int init_spill(Spill* spill, int stride, size_t cache_bytes)
+{
+    spill->file = tmpfile();
+    spill->stride = stride;
+    spill->count = 0;
+
+    spill->slot_count = cache_bytes / (SPILL_PAGE_FLOATS*sizeof(float));
+    if (spill->slot_count < 1) { spill->slot_count = 1; }
+
+    spill->tags = (long*) calloc(spill->slot_count, sizeof(long));
+    spill->pages = (float*) calloc(spill->slot_count*SPILL_PAGE_FLOATS, sizeof(float));
+
+    if (!spill->file || !spill->tags || !spill->pages) { return ERR; }
+    for (int i = 0; i < spill->slot_count; i++) { spill->tags[i] = -1; }
+
+    return NOERR;
+}
+
+static void free_spill(Spill* spill)
+{
+    if (spill->file) { fclose(spill->file); spill->file = NULL; }
+    free(spill->tags); spill->tags = NULL;
+    free(spill->pages); spill->pages = NULL;
+}
+
+// Reads attribute index (0 based) into out, returns ERR if it does not exist
+static int read_spill(Spill* spill, long index, float* out)
+{
+    if (index < 0 || index >= spill->count) { return ERR; }
+
+    long first = index * spill->stride;
+    long page = first / SPILL_PAGE_FLOATS;
+    int slot = page % spill->slot_count;
+    float* data = &spill->pages[(size_t) slot*SPILL_PAGE_FLOATS];
+
+    // Page miss: read it from the spill file
+    if (spill->tags[slot] != page)
+    {
+        fseeko(spill->file, (off_t) page*SPILL_PAGE_FLOATS*sizeof(float), SEEK_SET);
+        fread(data, sizeof(float), SPILL_PAGE_FLOATS, spill->file); // last page may be short
+        spill->tags[slot] = page;
+    }
+
+    memcpy(out, &data[first - page*SPILL_PAGE_FLOATS], spill->stride*sizeof(float));
+    return NOERR;
+}
+
+// Converts an OBJ index (1 based, or negative relative to the end) to a 0 based index
+static long resolve_index(long index, long count)
+{
+    if (index < 0) { return count + index; }
+    return index - 1;
+}
+
+// Maps a point to its cell in a grid x grid x grid split of the box lo..hi
+static int cell_of(const float* p, const float* lo, const float* hi, int grid)
+{
+    int cell[3];
+
+    for (int a = 0; a < 3; a++)
+    {
+        float extent = hi[a] - lo[a];
+        cell[a] = extent > 0 ? (int) ((p[a]-lo[a]) / extent * grid) : 0;
+        if (cell[a] < 0) { cell[a] = 0; }
+        if (cell[a] >= grid) { cell[a] = grid-1; }
+    }
+
+    return (cell[2]*grid + cell[1])*grid + cell[0];
+}
+
+// Appends count empty cells, returns the index of the first or ERR if the table is full
+static int add_cells(Chunker* ck, int count)
+{
+    int first = ck->cell_count;
+
+    if (ck->cell_count + count > ck->cell_size)
+    { fprintf(stderr, "Too many chunks for the memory cap, raise --mem-cap.\n"); return ERR; }
+
+    for (int c = first; c < first+count; c++)
+    {
+        Cell* cell = &ck->cells[c];
+        cell->tri_count = 0;
+        cell->bounds[0] = cell->bounds[1] = cell->bounds[2] = FLT_MAX;
+        cell->bounds[3] = cell->bounds[4] = cell->bounds[5] = -FLT_MAX;
+        cell->split_by_order = FALSE;
+        cell->first_block = cell->last_block = NO_BLOCK;
+    }
+
+    ck->cell_count += count;
+    return first;
+}
+
+// Takes a block off the free list and appends it to cell's blocks
+static void add_block(Chunker* ck, int cell, long tri_count, off_t offset)
+{
+    long b = ck->free_block;
+    Cell* target = &ck->cells[cell];
+
+    // reserve_blocks keeps enough free between its calls
+    assert(b != NO_BLOCK);
+    ck->free_block = ck->blocks[b].next;
+    ck->free_count--;
+
+    ck->blocks[b].tri_count = tri_count;
+    ck->blocks[b].offset = offset;
+    ck->blocks[b].next = NO_BLOCK;
+
+    if (target->last_block == NO_BLOCK) { target->first_block = b; }
+    else { ck->blocks[target->last_block].next = b; }
+    target->last_block = b;
+}
+
+// Returns a chain of blocks to the free list
+static void free_blocks(Chunker* ck, long first)
+{
+    while (first != NO_BLOCK)
+    {
+        long next = ck->blocks[first].next;
+        ck->blocks[first].next = ck->free_block;
+        ck->free_block = first;
+        ck->free_count++;
+        first = next;
+    }
+}
+
+// Reads up to max_tris triangles of block starting at triangle done into buffer, returns
+// how many were read or ERR
+static long read_block(Chunker* ck, Block* block, long done, float* buffer, long max_tris)
+{
+    long count = block->tri_count - done < max_tris ? block->tri_count - done : max_tris;
+
+    fseeko(ck->staging, block->offset + (off_t) done*TRI_BYTES, SEEK_SET);
+    if (fread(buffer, TRI_BYTES, count, ck->staging) != count)
+    { fprintf(stderr, "Could not read back staging file.\n"); return ERR; }
+
+    return count;
+}
+
+// Appends write buffer slot to the end of the staging file as a block of cell
+static void flush_chunk(Chunker* ck, int slot, int cell)
+{
+    // Blocks are read back from the same file, so always seek to the end
+    fseeko(ck->staging, 0, SEEK_END);
+    add_block(ck, cell, ck->buffered[slot], ftello(ck->staging));
+    ck->blocks_written++;
+
+    fwrite(&ck->buffers[(size_t) slot*ck->buffer_tris*TRI_FLOATS], TRI_BYTES, ck->buffered[slot], ck->staging);
+    ck->buffered[slot] = 0;
+}
+
+// Copies each cell's blocks to the end of the staging file as a single block
+static int merge_blocks(Chunker* ck)
+{
+    for (int c = 0; c < ck->cell_count; c++)
+    {
+        long first = ck->cells[c].first_block;
+        long tri_count = 0;
+        off_t offset = 0;
+
+        if (first == NO_BLOCK || first == ck->cells[c].last_block) { continue; }
+
+        fseeko(ck->staging, 0, SEEK_END);
+        offset = ftello(ck->staging);
+
+        for (long b = first; b != NO_BLOCK; b = ck->blocks[b].next)
+        {
+            for (long done = 0; done < ck->blocks[b].tri_count; )
+            {
+                long count = read_block(ck, &ck->blocks[b], done, ck->read_buffer, ck->buffer_tris);
+                if (count < NOERR) { return ERR; }
+
+                fseeko(ck->staging, 0, SEEK_END);
+                fwrite(ck->read_buffer, TRI_BYTES, count, ck->staging);
+                done += count;
+            }
+            tri_count += ck->blocks[b].tri_count;
+        }
+
+        ck->cells[c].first_block = ck->cells[c].last_block = NO_BLOCK;
+        free_blocks(ck, first);
+        add_block(ck, c, tri_count, offset);
+    }
+
+    return NOERR;
+}
+
+// Makes sure count blocks are free for the flushes that can happen before the next call,
+// merging if needed. Must not be called while read_buffer is in use.
+static int reserve_blocks(Chunker* ck, long count)
+{
+    if (ck->free_count >= count) { return NOERR; }
+    if (merge_blocks(ck) < NOERR) { return ERR; }
+
+    if (ck->free_count < count)
+    { fprintf(stderr, "Too many staging blocks for the memory cap, raise --mem-cap.\n"); return ERR; }
+
+    return NOERR;
+}
+
+// Adds a triangle to cell through write buffer slot
+static void bin_triangle(Chunker* ck, int slot, int cell, const float* tri)
+{
+    Cell* target = &ck->cells[cell];
+
+    // Triangles near a cell border may stick out, so track the actual bounds
+    for (int k = 0; k < 3; k++)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            target->bounds[a] = fminf(target->bounds[a], tri[k*8+5+a]);
+            target->bounds[3+a] = fmaxf(target->bounds[3+a], tri[k*8+5+a]);
+        }
+    }
+    target->tri_count++;
+
+    memcpy(&ck->buffers[((size_t) slot*ck->buffer_tris + ck->buffered[slot])*TRI_FLOATS], tri, TRI_BYTES);
+    ck->buffered[slot]++;
+
+    // Buffer full: flush it to the staging file as a block
+    if (ck->buffered[slot] == ck->buffer_tris) { flush_chunk(ck, slot, cell); }
+}
+
+static void centroid_of(const float* tri, float* centroid)
+{
+    for (int a = 0; a < 3; a++) { centroid[a] = (tri[5+a] + tri[13+a] + tri[21+a]) / 3.0f; }
+}
+
+// Moves a cell's triangles into new child cells small enough for max_bytes, or at least
+// closer to it. Children that are still too big are split again by the caller.
+static int split_cell(Chunker* ck, int c, size_t max_bytes)
+{
+    Cell parent = ck->cells[c];
+    long pieces = ((size_t) parent.tri_count*TRI_BYTES + max_bytes-1) / max_bytes;
+    long seen = 0;
+    int grid = 2, child_count = 0, first = 0, kept = 0;
+
+    // Split in space with a grid just fine enough for evenly spread triangles, or into runs
+    // of triangles if space didn't help last time
+    while (grid < CHUNK_GRID && grid*grid*grid < pieces) { grid++; }
+    if (parent.split_by_order) { child_count = pieces < CHUNK_COUNT ? pieces : CHUNK_COUNT; }
+    else { child_count = grid*grid*grid; }
+
+    first = add_cells(ck, child_count);
+    if (first < NOERR) { return ERR; }
+
+    // Take the parent's blocks off it so merging leaves them alone while they are read
+    ck->cells[c].first_block = ck->cells[c].last_block = NO_BLOCK;
+    ck->cells[c].tri_count = 0;
+
+    for (long b = parent.first_block; b != NO_BLOCK; )
+    {
+        long next = ck->blocks[b].next;
+
+        for (long done = 0; done < ck->blocks[b].tri_count; )
+        {
+            // Each triangle read fills at most one child's buffer
+            if (reserve_blocks(ck, ck->buffer_tris) < NOERR) { return ERR; }
+
+            long count = read_block(ck, &ck->blocks[b], done, ck->read_buffer, ck->buffer_tris);
+            if (count < NOERR) { return ERR; }
+            done += count;
+
+            for (int i = 0; i < count; i++, seen++)
+            {
+                float* tri = &ck->read_buffer[(size_t) i*TRI_FLOATS];
+                float centroid[3];
+                int child = 0;
+
+                if (parent.split_by_order) { child = seen * child_count / parent.tri_count; }
+                else { centroid_of(tri, centroid); child = cell_of(centroid, &parent.bounds[0], &parent.bounds[3], grid); }
+
+                bin_triangle(ck, child, first+child, tri);
+            }
+        }
+
+        ck->blocks[b].next = NO_BLOCK;
+        free_blocks(ck, b);
+        b = next;
+    }
+
+    if (reserve_blocks(ck, child_count) < NOERR) { return ERR; }
+    for (int s = 0; s < child_count; s++)
+    { if (ck->buffered[s] > 0) { flush_chunk(ck, s, first+s); } }
+
+    // All the triangles landing in one child (e.g. they share a centroid) is no progress
+    for (int s = 0; s < child_count; s++)
+    { if (ck->cells[first+s].tri_count == parent.tri_count) { ck->cells[first+s].split_by_order = TRUE; } }
+
+    // Drop empty children so they don't take up the cell table
+    for (int s = 0; s < child_count; s++)
+    { if (ck->cells[first+s].tri_count > 0) { ck->cells[first + kept++] = ck->cells[first+s]; } }
+    ck->cell_count = first + kept;
+
+    return NOERR;
+}
+
+int preprocess_obj(char* obj_filename, char* chunk_filename, size_t mem_cap)
+{
+    /* Variables */
+
+    FILE* obj_file = fopen(obj_filename, "r"); // the obj file itself
+    FILE* out_file = NULL; // the chunk file
+
+    char* line = (char*) calloc(LINE_SIZE, sizeof(char));
+    Spill positions, uvs, normals;
+    float model_bounds[6] = { FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+    // Chunks may be at most this big so several fit in the budget at once
+    size_t max_bytes = mem_cap / CHUNK_FRACTION;
+    Chunker ck;
+
+    long tri_total = 0;
+    int chunk_count = 0;
+    double start = get_time();
+
+    memset(&positions, 0, sizeof(Spill));
+    memset(&uvs, 0, sizeof(Spill));
+    memset(&normals, 0, sizeof(Spill));
+    memset(&ck, 0, sizeof(Chunker));
+
+    // error check obj file
+    if (!obj_file) { fprintf(stderr, "Could not open %s\n", obj_filename); return ERR; }
+    if (mem_cap < MIN_CHUNK_BUDGET)
+    { fprintf(stderr, "Memory cap must be at least %d bytes.\n", MIN_CHUNK_BUDGET); return ERR; }
+
+    // Half the budget goes to the spill caches, 1/META_FRACTION to the cell and block tables
+    // and the rest to the chunk write buffers and the read buffer
+    if (init_spill(&positions, 3, mem_cap/6) < NOERR ||
+        init_spill(&uvs, 2, mem_cap/6) < NOERR ||
+        init_spill(&normals, 3, mem_cap/6) < NOERR)
+    { fprintf(stderr, "Could not create temporary files.\n"); return ERR; }
+
+    ck.buffer_tris = (mem_cap/2 - mem_cap/META_FRACTION) / (CHUNK_COUNT+1) / TRI_BYTES;
+    if (ck.buffer_tris < 1) { ck.buffer_tris = 1; }
+
+    ck.cell_size = mem_cap/META_FRACTION/2 / sizeof(Cell);
+    ck.block_size = mem_cap/META_FRACTION/2 / sizeof(Block);
+    ck.cells = (Cell*) calloc(ck.cell_size, sizeof(Cell));
+    ck.blocks = (Block*) calloc(ck.block_size, sizeof(Block));
+    ck.free_block = NO_BLOCK;
+    if (ck.blocks) { for (long b = ck.block_size-1; b >= 0; b--) { ck.blocks[b].next = ck.free_block; ck.free_block = b; } }
+    ck.free_count = ck.block_size;
+
+    ck.buffers = (float*) calloc((size_t) CHUNK_COUNT*ck.buffer_tris*TRI_FLOATS, sizeof(float));
+    ck.buffered = (int*) calloc(CHUNK_COUNT, sizeof(int));
+    ck.read_buffer = (float*) calloc((size_t) ck.buffer_tris*TRI_FLOATS, sizeof(float));
+    ck.staging = tmpfile();
+
+    if (!ck.buffers || !ck.buffered || !ck.read_buffer || !ck.staging || !ck.cells || !ck.blocks ||
+        add_cells(&ck, CHUNK_COUNT) < NOERR)
+    { fprintf(stderr, "Out of memory preprocessing %s\n", obj_filename); return ERR; }
+
+    /* Pass 1: spill vertex attributes and find the model's bounds */
+
+    while (fgets(line, LINE_SIZE, obj_file))
+    {
+        float f[3] = { 0.0f, 0.0f, 0.0f };
+
+        if (!strchr(line, '\n') && !feof(obj_file))
+        { fprintf(stderr, "Line longer than %d characters in %s\n", LINE_SIZE, obj_filename); return ERR; }
+
+        if (strncmp(line, "vt ", 3) == STR_EQUAL)
+        {
+            sscanf(line+3, "%f %f", &f[0], &f[1]);
+            fwrite(f, sizeof(float), 2, uvs.file);
+            uvs.count++;
+        }
+        else if (strncmp(line, "vn ", 3) == STR_EQUAL)
+        {
+            sscanf(line+3, "%f %f %f", &f[0], &f[1], &f[2]);
+            fwrite(f, sizeof(float), 3, normals.file);
+            normals.count++;
+        }
+        else if (strncmp(line, "v ", 2) == STR_EQUAL)
+        {
+            sscanf(line+2, "%f %f %f", &f[0], &f[1], &f[2]);
+            fwrite(f, sizeof(float), 3, positions.file);
+            positions.count++;
+
+            for (int a = 0; a < 3; a++)
+            {
+                model_bounds[a] = fminf(model_bounds[a], f[a]);
+                model_bounds[3+a] = fmaxf(model_bounds[3+a], f[a]);
+            }
+        }
+    }
+
+    fflush(positions.file);
+    fflush(uvs.file);
+    fflush(normals.file);
+
+    /* Pass 2: triangulate faces and sort them into a CHUNK_GRID^3 grid */
+
+    fseek(obj_file, 0, SEEK_SET);
+    while (fgets(line, LINE_SIZE, obj_file))
+    {
+        float corners[MAX_FACE_VERTS][8]; // u, v, nx, ny, nz, x, y, z
+        int corner_count = 0;
+        bool has_normals = TRUE;
+        char* token = NULL;
+
+        if (strncmp(line, "f ", 2) != STR_EQUAL) { continue; }
+
+        // Resolve each "v", "v/t", "v//n" or "v/t/n" corner through the spill caches
+        token = strtok(line+2, " \t\r\n");
+        while (token && corner_count < MAX_FACE_VERTS)
+        {
+            float* corner = corners[corner_count];
+            char* end = token;
+            long v = strtol(end, &end, 10), t = 0, n = 0;
+
+            if (*end == '/') { end++; t = strtol(end, &end, 10); }
+            if (*end == '/') { end++; n = strtol(end, &end, 10); }
+
+            memset(corner, 0, 8*sizeof(float));
+            if (read_spill(&positions, resolve_index(v, positions.count), &corner[5]) < NOERR)
+            { fprintf(stderr, "Bad vertex index %ld in %s\n", v, obj_filename); return ERR; }
+            if (t != 0) { read_spill(&uvs, resolve_index(t, uvs.count), &corner[0]); }
+            if (n == 0 || read_spill(&normals, resolve_index(n, normals.count), &corner[2]) < NOERR)
+            { has_normals = FALSE; }
+
+            corner_count++;
+            token = strtok(NULL, " \t\r\n");
+        }
+
+        // Fan triangulate
+        for (int k = 1; k+1 < corner_count; k++)
+        {
+            float tri[TRI_FLOATS];
+            float centroid[3];
+
+            memcpy(&tri[0], corners[0], 8*sizeof(float));
+            memcpy(&tri[8], corners[k], 8*sizeof(float));
+            memcpy(&tri[16], corners[k+1], 8*sizeof(float));
+
+            // Faces without normals get a flat face normal
+            if (!has_normals)
+            {
+                float e1[3] = { tri[13]-tri[5], tri[14]-tri[6], tri[15]-tri[7] };
+                float e2[3] = { tri[21]-tri[5], tri[22]-tri[6], tri[23]-tri[7] };
+                float nrm[3] = { e1[1]*e2[2]-e1[2]*e2[1], e1[2]*e2[0]-e1[0]*e2[2], e1[0]*e2[1]-e1[1]*e2[0] };
+                float len = sqrtf(nrm[0]*nrm[0] + nrm[1]*nrm[1] + nrm[2]*nrm[2]);
+                if (len > 0) { nrm[0] /= len; nrm[1] /= len; nrm[2] /= len; }
+                for (int c = 0; c < 3; c++) { memcpy(&tri[c*8+2], nrm, 3*sizeof(float)); }
+            }
+
+            // The first CHUNK_COUNT cells are the grid, each with its own write buffer
+            centroid_of(tri, centroid);
+            int c = cell_of(centroid, &model_bounds[0], &model_bounds[3], CHUNK_GRID);
+            if (reserve_blocks(&ck, 1) < NOERR) { fprintf(stderr, "Could not stage %s\n", obj_filename); return ERR; }
+            bin_triangle(&ck, c, c, tri);
+            tri_total++;
+        }
+    }
+
+    // Flush the partially filled buffers so every triangle is in a block
+    if (reserve_blocks(&ck, CHUNK_COUNT) < NOERR) { fprintf(stderr, "Could not stage %s\n", obj_filename); return ERR; }
+    for (int c = 0; c < CHUNK_COUNT; c++) { if (ck.buffered[c] > 0) { flush_chunk(&ck, c, c); } }
+
+    /* Split cells that are too big for the cap, including new cells that still are */
+
+    for (int c = 0; c < ck.cell_count; c++)
+    {
+        if ((size_t) ck.cells[c].tri_count*TRI_BYTES > max_bytes && split_cell(&ck, c, max_bytes) < NOERR)
+        { fprintf(stderr, "Could not split chunks of %s\n", obj_filename); return ERR; }
+    }
+
+    /* Pass 3: write the chunk file with each non empty cell's triangles contiguous */
+
+    out_file = fopen(chunk_filename, "wb");
+    if (!out_file) { fprintf(stderr, "Could not open %s\n", chunk_filename); return ERR; }
+
+    for (int c = 0; c < ck.cell_count; c++) { if (ck.cells[c].tri_count > 0) { chunk_count++; } }
+
+    int textured = uvs.count > 0;
+    off_t offset = CHUNK_MAGIC_SIZE + 2*sizeof(int) +
+                   (off_t) chunk_count*(6*sizeof(float) + sizeof(int) + sizeof(long long));
+
+    fwrite(CHUNK_MAGIC, sizeof(char), CHUNK_MAGIC_SIZE, out_file);
+    fwrite(&chunk_count, sizeof(int), 1, out_file);
+    fwrite(&textured, sizeof(int), 1, out_file);
+
+    for (int c = 0; c < ck.cell_count; c++)
+    {
+        int count = ck.cells[c].tri_count;
+        long long chunk_offset = offset;
+
+        if (count == 0) { continue; }
+
+        fwrite(ck.cells[c].bounds, sizeof(float), 6, out_file);
+        fwrite(&count, sizeof(int), 1, out_file);
+        fwrite(&chunk_offset, sizeof(long long), 1, out_file);
+        offset += (off_t) count*TRI_BYTES;
+    }
+
+    // Copy each cell's blocks out in order through the now unused write buffers
+    for (int c = 0; c < ck.cell_count; c++)
+    {
+        for (long b = ck.cells[c].first_block; b != NO_BLOCK; b = ck.blocks[b].next)
+        {
+            for (long done = 0; done < ck.blocks[b].tri_count; )
+            {
+                long count = read_block(&ck, &ck.blocks[b], done, ck.buffers, (long) CHUNK_COUNT*ck.buffer_tris);
+                if (count < NOERR) { return ERR; }
+                fwrite(ck.buffers, TRI_BYTES, count, out_file);
+                done += count;
+            }
+        }
+    }
+
+    if (ferror(out_file))
+    { fprintf(stderr, "Error writing %s\n", chunk_filename); return ERR; }
+
+    printf("Preprocessed %s: %ld triangles into %d chunks of at most %.1f MB, %ld blocks, %.2f s\n",
+           obj_filename, tri_total, chunk_count, max_bytes/(1024.0*1024.0), ck.blocks_written, get_time() - start);
+
+    /* Garbage Collection */
+
+    fclose(out_file); out_file = NULL;
+    fclose(ck.staging); ck.staging = NULL;
+    fclose(obj_file); obj_file = NULL;
+    free_spill(&positions);
+    free_spill(&uvs);
+    free_spill(&normals);
+    free(line); line = NULL;
+    free(ck.buffers); ck.buffers = NULL;
+    free(ck.buffered); ck.buffered = NULL;
+    free(ck.read_buffer); ck.read_buffer = NULL;
+    free(ck.cells); ck.cells = NULL;
+    free(ck.blocks); ck.blocks = NULL;
+
+    return NOERR;
+}
+
+ChunkedModel* open_chunked(char* filename, size_t budget)
+{
+    /* Variables */
+
+    LoadProfile profile;
+    double phase_start = get_time();
+
+    FILE* chunk_file = fopen(filename, "rb");
+    ChunkedModel* cm = NULL;
+    char magic[CHUNK_MAGIC_SIZE];
+    int chunk_count = 0, textured = 0;
+
+    /* Reading the chunk table */
+
+    init_profile(&profile, "chunked", filename);
+
+    // error check the file
+    if (!chunk_file) { fprintf(stderr, "Could not open %s\n", filename); finish_profile(&profile); return NULL; }
+
+    if (fread(magic, sizeof(char), CHUNK_MAGIC_SIZE, chunk_file) != CHUNK_MAGIC_SIZE ||
+        memcmp(magic, CHUNK_MAGIC, CHUNK_MAGIC_SIZE) != STR_EQUAL ||
+        fread(&chunk_count, sizeof(int), 1, chunk_file) != 1 ||
+        fread(&textured, sizeof(int), 1, chunk_file) != 1 ||
+        chunk_count <= 0)
+    { fprintf(stderr, "%s is not a chunk file.\n", filename); fclose(chunk_file); finish_profile(&profile); return NULL; }
+
+    cm = (ChunkedModel*) calloc(1, sizeof(ChunkedModel));
+    cm->file = chunk_file;
+    cm->textured = textured;
+    cm->budget = budget;
+    cm->chunk_count = chunk_count;
+    cm->chunks = (Chunk*) calloc(chunk_count, sizeof(Chunk));
+
+    for (int c = 0; c < chunk_count; c++)
+    {
+        Chunk* chunk = &cm->chunks[c];
+        float bounds[6];
+        long long offset;
+
+        if (fread(bounds, sizeof(float), 6, chunk_file) != 6 ||
+            fread(&chunk->tri_count, sizeof(int), 1, chunk_file) != 1 ||
+            fread(&offset, sizeof(long long), 1, chunk_file) != 1)
+        { fprintf(stderr, "Chunk table in %s is truncated.\n", filename); finish_profile(&profile); return NULL; }
+
+        chunk->bounds_min.x = bounds[0]; chunk->bounds_min.y = bounds[1]; chunk->bounds_min.z = bounds[2];
+        chunk->bounds_max.x = bounds[3]; chunk->bounds_max.y = bounds[4]; chunk->bounds_max.z = bounds[5];
+        chunk->offset = offset;
+        chunk->data = NULL;
+
+        // A chunk bigger than the whole budget can never be shown
+        if ((size_t) chunk->tri_count*TRI_BYTES > budget)
+        {
+            fprintf(stderr, "WARNING: Chunk %d of %s does not fit in the memory cap, "
+                            "preprocess it again with this --mem-cap.\n", c, filename);
+        }
+    }
+
+    // Chunk data is accounted for as it is paged in, see scene_profile
+    profile_phase(&profile, PHASE_IO, phase_start);
+    profile_bytes(&profile, MEM_BOOKKEEPING, sizeof(ChunkedModel) + chunk_count*sizeof(Chunk));
+    register_profile(&profile, cm);
+
+    return cm;
+}
+
+// Tests a chunk's bounds against the orthographic view volume in eye space
+static bool chunk_visible(Chunk* chunk, float half_w, float half_h, float depth)
+{
+    float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+    // Eye space bounds of the rotated box
+    for (int i = 0; i < 8; i++)
+    {
+        Vector3f p = { (i & 1) ? chunk->bounds_max.x : chunk->bounds_min.x,
+                       (i & 2) ? chunk->bounds_max.y : chunk->bounds_min.y,
+                       (i & 4) ? chunk->bounds_max.z : chunk->bounds_min.z };
+        model_to_eye(&p);
+
+        lo[0] = fminf(lo[0], p.x); lo[1] = fminf(lo[1], p.y); lo[2] = fminf(lo[2], p.z);
+        hi[0] = fmaxf(hi[0], p.x); hi[1] = fmaxf(hi[1], p.y); hi[2] = fmaxf(hi[2], p.z);
+    }
+
+    return lo[0] <= half_w && hi[0] >= -half_w &&
+           lo[1] <= half_h && hi[1] >= -half_h &&
+           lo[2] <= depth && hi[2] >= -depth;
+}
+
+static void evict_chunk(ChunkedModel* cm, Chunk* chunk)
+{
+    free(chunk->data); chunk->data = NULL;
+    cm->resident_bytes -= (size_t) chunk->tri_count*TRI_BYTES;
+    cm->resident_count--;
+    cm->evictions++;
+}
+
+void page_chunks(Scene* scene, ChunkedModel* cm)
+{
+    float half_w, half_h;
+
+    get_view_extents(scene, &half_w, &half_h);
+    cm->frame++;
+
+    // Mark what is visible this frame first so eviction never throws out a chunk that is
+    // about to be drawn while an invisible one stays resident
+    for (int c = 0; c < cm->chunk_count; c++)
+    {
+        Chunk* chunk = &cm->chunks[c];
+        if (chunk->tri_count > 0 && chunk_visible(chunk, half_w, half_h, scene->view_area_scale))
+        {
+            chunk->last_visible = cm->frame;
+            if (chunk->data) { chunk->last_used = cm->frame; }
+        }
+    }
+
+    for (int c = 0; c < cm->chunk_count; c++)
+    {
+        Chunk* chunk = &cm->chunks[c];
+        size_t bytes = (size_t) chunk->tri_count*TRI_BYTES;
+
+        if (chunk->last_visible != cm->frame || chunk->data) { continue; }
+        if (bytes > cm->budget) { continue; }
+
+        // Make room by evicting the least recently used chunks that are not visible
+        while (cm->resident_bytes + bytes > cm->budget)
+        {
+            Chunk* lru = NULL;
+            for (int i = 0; i < cm->chunk_count; i++)
+            {
+                Chunk* other = &cm->chunks[i];
+                if (!other->data || other->last_visible == cm->frame) { continue; }
+                if (!lru || other->last_used < lru->last_used) { lru = other; }
+            }
+            if (!lru) { break; }
+            evict_chunk(cm, lru);
+        }
+
+        // Everything resident is visible and the budget is full, so skip this chunk
+        if (cm->resident_bytes + bytes > cm->budget) { cm->skipped++; continue; }
+
+        /* Page in */
+
+        double start = get_time();
+        chunk->data = (float*) malloc(bytes);
+
+        fseeko(cm->file, (off_t) chunk->offset, SEEK_SET);
+        if (!chunk->data || fread(chunk->data, TRI_BYTES, chunk->tri_count, cm->file) != chunk->tri_count)
+        {
+            fprintf(stderr, "Could not page in chunk %d.\n", c);
+            free(chunk->data); chunk->data = NULL;
+            continue;
+        }
+
+        double latency = get_time() - start;
+        cm->page_in_time += latency;
+        if (latency > cm->page_in_max) { cm->page_in_max = latency; }
+        cm->page_ins++;
+
+        cm->resident_bytes += bytes;
+        cm->resident_count++;
+        chunk->last_used = cm->frame;
+    }
+}
+
+void render_chunks(ChunkedModel* cm)
+{
+    if (cm->textured && cm->texture) { glBindTexture(GL_TEXTURE_2D, *(cm->texture)); }
+
+    // Chunks are stored in the layout glInterleavedArrays expects
+    for (int c = 0; c < cm->chunk_count; c++)
+    {
+        Chunk* chunk = &cm->chunks[c];
+        if (!chunk->data || chunk->last_visible != cm->frame) { continue; }
+
+        glInterleavedArrays(GL_T2F_N3F_V3F, 0, chunk->data);
+        glDrawArrays(GL_TRIANGLES, 0, chunk->tri_count*3);
+    }
+
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+void print_chunk_stats(ChunkedModel* cm)
+{
+    int visible = 0;
+    for (int c = 0; c < cm->chunk_count; c++)
+    { if (cm->chunks[c].last_visible == cm->frame) { visible++; } }
+
+    printf("Chunks: %d resident, %d visible, %d total\n", cm->resident_count, visible, cm->chunk_count);
+    printf("Memory: %.2f MB resident of %.2f MB cap\n",
+           cm->resident_bytes / 1048576.0, cm->budget / 1048576.0);
+    printf("Paging: %ld page-ins, %ld evictions, %ld skipped for lack of memory\n",
+           cm->page_ins, cm->evictions, cm->skipped);
+    printf("Page-in latency: %.3f ms mean, %.3f ms max\n",
+           cm->page_ins ? cm->page_in_time / cm->page_ins * 1000.0 : 0.0, cm->page_in_max * 1000.0);
+}
@@ -3,7 +3,11 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __APPLE__
 #include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
 #include <GLFW/glfw3.h>
 
 #include "objtest.h"
@@ -32,18 +36,19 @@ typedef struct tga_header
     char descriptor;
 } TGA_Header;
 
-Texture* load_tex(char* filename)
+Image* read_tga(char* filename, LoadProfile* profile)
 {
     /* Variables */
     
+    double phase_start = get_time();
     // Buffer for reading the header
     unsigned char* buffer = (unsigned char*) calloc(H_SIZE, sizeof(unsigned char));
     // Header object for storing the TGA file's properties
     TGA_Header* header = (TGA_Header*) calloc(1, sizeof(TGA_Header));
     // The TGA file itself
     FILE* tex_file = fopen(filename, "rb");
-    // Texture to return
-    Texture* textureID = NULL;
+    // Image to return
+    Image* image = NULL;
     
     /* Parsing the image file */
     
@@ -54,6 +59,9 @@ Texture* load_tex(char* filename)
     if (fread(buffer, sizeof(char), H_SIZE, tex_file) != H_SIZE)
     { fprintf(stderr, "Texture file corrupted.\n"); return NULL; }
 
+    profile_phase(profile, PHASE_IO, phase_start);
+    phase_start = get_time();
+
     // Parse the file header and place results in the header object.
     // We can't just read it directly into the object because TGA files are little endian.
     header->id_length = buffer[0];
@@ -96,6 +104,9 @@ Texture* load_tex(char* filename)
         fseek(tex_file, header->id_length+H_SIZE, SEEK_SET);
     }
 
+    profile_phase(profile, PHASE_PARSE, phase_start);
+    phase_start = get_time();
+
     // Calculate the number of bytes needed to hold the pixel data
     int byte_count = header->width*header->height*(header->bitsperpixel/8);
 
@@ -106,11 +117,82 @@ Texture* load_tex(char* filename)
     if (fread(data, sizeof(unsigned char), byte_count, tex_file) < byte_count)
     { fprintf(stderr, "Unexpected end of texture file.\n"); return NULL; }
 
+    profile_phase(profile, PHASE_IO, phase_start);
+
+    // Create Image object for return
+    image = (Image*) calloc(1, sizeof(Image));
+    image->width = header->width;
+    image->height = header->height;
+    image->pixels = data;
+
+    /* Garbage Collection */
+
+    free (buffer); buffer = NULL;
+    free (header); header = NULL;
+    fclose(tex_file); tex_file = NULL;
+
+    return image;
+}
+
+int write_tga(char* filename, Image* image)
+{
+    unsigned char header[H_SIZE];
+    FILE* tex_file = fopen(filename, "wb");
+
+    // error check the file
+    if (!tex_file) { fprintf(stderr, "Could not open %s for writing.\n", filename); return ERR; }
+
+    // Uncompressed 24 bit, origin in the bottom left like OpenGL
+    memset(header, 0, H_SIZE);
+    header[2] = U_RGB;
+    header[12] = image->width & 0xFF; header[13] = (image->width >> 8) & 0xFF; //little endian
+    header[14] = image->height & 0xFF; header[15] = (image->height >> 8) & 0xFF;
+    header[16] = RGB_24;
+
+    fwrite(header, sizeof(unsigned char), H_SIZE, tex_file);
+    fwrite(image->pixels, sizeof(unsigned char), image->width*image->height*3, tex_file);
+
+    if (ferror(tex_file))
+    { fprintf(stderr, "Error writing %s\n", filename); fclose(tex_file); return ERR; }
+
+    fclose(tex_file); tex_file = NULL;
+
+    return NOERR;
+}
+
+void free_image(Image* image)
+{
+    if (!image) { return; }
+
+    free(image->pixels);
+    free(image);
+}
+
+Texture* load_tex(char* filename)
+{
+    /* Variables */
+
+    // Memory use and timings of this load
+    LoadProfile profile;
+    double phase_start = 0;
+    // Pixels read from the TGA file
+    Image* image = NULL;
+    // Texture to return
+    Texture* textureID = NULL;
+
+    /* Reading the image file */
+
+    init_profile(&profile, "texture", filename);
+
+    image = read_tga(filename, &profile);
+    if (!image) { finish_profile(&profile); return NULL; }
+
+    phase_start = get_time();
+
     /* 
      * Passing the image to OpenGL
-     * In a real program we'd want to separate this part of the function out and have it
-     * access the first part of the function through a generic interface so we could create
-     * loaders for any file format without reusing the following code.
+     * read_tga is shared with the headless thumbnail renderer, so only the OpenGL part
+     * lives here.
      */
 
     // create a GLuint object
@@ -123,19 +205,46 @@ Texture* load_tex(char* filename)
     glBindTexture(GL_TEXTURE_2D, *textureID);
 
     // Pass the pixels read from the TGA file to OpenGL
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, header->width, header->height, 0, 
-                 GL_BGR, GL_UNSIGNED_BYTE, data);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image->width, image->height, 0, 
+                 GL_BGR, GL_UNSIGNED_BYTE, image->pixels);
 
     // Set filtering to nearest for demo purposes
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 
+    // Only level 0 exists since there are no mipmaps with nearest filtering
+    profile_phase(&profile, PHASE_UPLOAD, phase_start);
+    profile_bytes(&profile, MEM_TEXTURE_LEVELS, image->width*image->height*3);
+    profile_bytes(&profile, MEM_BOOKKEEPING, sizeof(GLuint));
+    register_profile(&profile, textureID);
+
     /* Garbage Collection */
 
     // OpenGL now stores what we need so we can free everything
-    free(data); data = NULL;
-    free (header); header = NULL;
-    fclose(tex_file); tex_file = NULL;
+    free_image(image); image = NULL;
+
+    return textureID;
+}
+
+Texture* read_tex(char* filename)
+{
+    LoadProfile profile;
+    Image* image = NULL;
+    Texture* textureID = NULL;
+
+    init_profile(&profile, "texture", filename);
+
+    image = read_tga(filename, &profile);
+    if (!image) { finish_profile(&profile); return NULL; }
+
+    // Texture name 0 is OpenGL's "no texture", nothing is ever uploaded. Account for the
+    // level load_tex would have uploaded so profiles match with and without a window.
+    textureID = (GLuint*) calloc(1, sizeof(GLuint));
+    profile_bytes(&profile, MEM_TEXTURE_LEVELS, image->width*image->height*3);
+    profile_bytes(&profile, MEM_BOOKKEEPING, sizeof(GLuint));
+    register_profile(&profile, textureID);
+
+    free_image(image); image = NULL;
 
     return textureID;
 }
@@ -171,12 +280,22 @@ Model* load_obj(char* filename)
     Vector2f* temp_vt = NULL; // used for 2D points during object creation
     Triangle* temp_f = NULL; // used for triangles during object creation
 
+    // Memory use and timings of this load. stdio reads lazily, so most of the time spent
+    // reading the file shows up under tokenize rather than io.
+    LoadProfile profile;
+    double phase_start = get_time();
+
     FILE* obj_file = fopen(filename, "r"); // the obj file itself
 
     /* Parsing the file */
 
+    init_profile(&profile, "model", filename);
+
     // error check obj file
-    if (!obj_file) { fprintf(stderr, "Could not open %s\n", filename); return NULL; }
+    if (!obj_file) { fprintf(stderr, "Could not open %s\n", filename); finish_profile(&profile); return NULL; }
+
+    profile_phase(&profile, PHASE_IO, phase_start);
+    phase_start = get_time();
 
     // run through the file once so we know how many objects to make
     while (scanret != EOF)
@@ -203,6 +322,9 @@ Model* load_obj(char* filename)
         { f_buff++; }
     }
 
+    profile_phase(&profile, PHASE_TOKENIZE, phase_start);
+    phase_start = get_time();
+
     // initialize our objects
     vertices = (Vector3f**) calloc(v_buff, sizeof(Vector3f*));
     uvs = (Vector2f**) calloc(vt_buff, sizeof(Vector2f*));
@@ -236,7 +358,7 @@ Model* load_obj(char* filename)
             uvs[vt_count] = temp_vt;
             vt_count++;
 
-            if (scanret == EOF) { fprintf(stderr, "Unexpected end of file.\n"); return NULL; }
+            if (scanret == EOF) { fprintf(stderr, "Unexpected end of file.\n"); finish_profile(&profile); return NULL; }
         }
 
         // Get normal vectors
@@ -247,7 +369,7 @@ Model* load_obj(char* filename)
             normals[vn_count] = temp;
             vn_count++;
 
-            if (scanret == EOF) { fprintf(stderr, "Unexpected end of file.\n"); return NULL; }
+            if (scanret == EOF) { fprintf(stderr, "Unexpected end of file.\n"); finish_profile(&profile); return NULL; }
         }
         
         // Get vertices
@@ -258,7 +380,7 @@ Model* load_obj(char* filename)
             vertices[v_count] = temp;
             v_count++;
 
-            if (scanret == EOF) { fprintf(stderr, "Unexpected end of file.\n"); return NULL; }
+            if (scanret == EOF) { fprintf(stderr, "Unexpected end of file.\n"); finish_profile(&profile); return NULL; }
         }
 
         // Get faces
@@ -311,22 +433,25 @@ Model* load_obj(char* filename)
             faces[f_count] = temp_f;
             f_count++;
 
-            if (scanret == EOF) { fprintf(stderr, "Unexpected end of file.\n"); return NULL; }
+            if (scanret == EOF) { fprintf(stderr, "Unexpected end of file.\n"); finish_profile(&profile); return NULL; }
         }
     }
 
+    profile_phase(&profile, PHASE_PARSE, phase_start);
+    phase_start = get_time();
+
     // Error checking
     // TODO: Garbage should be collected even when encountering an error
     if (!faces) 
-    { fprintf(stderr, "Could not generate faces from %s\n", filename); return NULL; }
+    { fprintf(stderr, "Could not generate faces from %s\n", filename); finish_profile(&profile); return NULL; }
     if (v_count != v_buff)
-    { fprintf(stderr, "Error reading vertices from %s\n", filename); return NULL; }
+    { fprintf(stderr, "Error reading vertices from %s\n", filename); finish_profile(&profile); return NULL; }
     if (vt_count != vt_buff)
-    { fprintf(stderr, "Error reading UV coordinates from %s\n", filename); return NULL; }
+    { fprintf(stderr, "Error reading UV coordinates from %s\n", filename); finish_profile(&profile); return NULL; }
     if (vn_count != vn_buff)
-    { fprintf(stderr, "Error reading normal vectors from %s\n", filename); return NULL; }
+    { fprintf(stderr, "Error reading normal vectors from %s\n", filename); finish_profile(&profile); return NULL; }
     if (f_count != f_buff)
-    { fprintf(stderr, "Error reading faces from %s\n", filename); return NULL; }
+    { fprintf(stderr, "Error reading faces from %s\n", filename); finish_profile(&profile); return NULL; }
 
     // Create Model object for return
     model = calloc(1, sizeof(Model));
@@ -334,18 +459,63 @@ Model* load_obj(char* filename)
     model->triangles = faces;
     model->tri_count = f_count;
 
+    // Keep the attribute arrays so the model can be freed later
+    model->vertices = vertices;
+    model->uvs = uvs;
+    model->normals = normals;
+    model->vertex_count = v_count;
+    model->uv_count = vt_count;
+    model->normal_count = vn_count;
+
     // If the model has UV coordinates, that implies it should be textured
     if (vt_count > 0) { model->textured = TRUE; }
 
+    // Account for everything the model keeps, the pointer arrays count as bookkeeping
+    profile_phase(&profile, PHASE_BUILD, phase_start);
+    profile_bytes(&profile, MEM_POSITIONS, v_count*sizeof(Vector3f));
+    profile_bytes(&profile, MEM_UVS, vt_count*sizeof(Vector2f));
+    profile_bytes(&profile, MEM_NORMALS, vn_count*sizeof(Vector3f));
+    profile_bytes(&profile, MEM_INDICES, f_count*sizeof(Triangle));
+    profile_bytes(&profile, MEM_BOOKKEEPING, sizeof(Model) +
+                  v_count*sizeof(Vector3f*) + vt_count*sizeof(Vector2f*) +
+                  vn_count*sizeof(Vector3f*) + f_count*sizeof(Triangle*));
+    register_profile(&profile, model);
+
     /* Garbage Collection */
 
     free (v); v = NULL;
     free (u); u = NULL;
     free (n); n = NULL;
+    free (buff); buff = NULL;
+    fclose(obj_file); obj_file = NULL;
 
     return model;
 }
 
+void free_model(Model* model)
+{
+    if (!model) { return; }
+
+    // Vertices, UVs and normals are shared between triangles, so free them through the
+    // model's arrays rather than through each triangle
+    for (int i = 0; i < model->vertex_count; i++) { free(model->vertices[i]); }
+    for (int i = 0; i < model->uv_count; i++) { free(model->uvs[i]); }
+    for (int i = 0; i < model->normal_count; i++) { free(model->normals[i]); }
+    for (int i = 0; i < model->tri_count; i++) { free(model->triangles[i]); }
+
+    free(model->vertices);
+    free(model->uvs);
+    free(model->normals);
+    free(model->triangles);
+
+    free_bvh(model->bvh);
+    free_meshlets(model->meshlets);
+    unregister_profile(model);
+
+    // The texture belongs to whoever loaded it and may be shared
+    free(model);
+}
+
 int assign_tex(Model* model, Texture* tex)
 {
     // Error checking
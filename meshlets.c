@@ -0,0 +1,420 @@
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+#include <GLFW/glfw3.h>
+
+#include "objtest.h"
+
+/*
+ * Meshlets: small clusters of triangles with a bounding sphere and a cone containing all
+ * of their face normals.
+ *
+ * The view is orthographic, so every triangle is seen along the same direction. A cluster
+ * faces away from the camera when its whole normal cone points along the view direction,
+ * and is outside the view when its sphere misses the view volume. Either way none of its
+ * triangles would survive the vertex stage, so the cluster is skipped before submission.
+ */
+
+/* Magic Numbers */
+#define CONE_NEVER_CULL 2.0f // cutoff no dot product of unit vectors can exceed
+#define CONE_SPLIT_DOT 0.8f // start a new meshlet when a face turns further than this from the rest
+#define BENCH_YAW_STEPS 36
+#define BENCH_PITCH_STEPS 18
+
+// Finds a position in the meshlet's vertex list, returns -1 if it is not there
+static int find_vertex(Vector3f** verts, int vert_count, Vector3f* v)
+{
+    for (int i = 0; i < vert_count; i++) { if (verts[i] == v) { return i; } }
+    return -1;
+}
+
+// Computes the bounding sphere and normal cone of meshlet m
+static void bound_meshlet(Meshlets* meshlets, Model* model, int m)
+{
+    Vector3f lo = { FLT_MAX, FLT_MAX, FLT_MAX }, hi = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    Vector3f axis = { 0.0f, 0.0f, 0.0f };
+    int first = meshlets->tri_offset[m];
+    int count = meshlets->tri_count[m];
+
+    // Sphere around the center of the cluster's bounding box
+    for (int i = first; i < first+count; i++)
+    {
+        Triangle* t = model->triangles[meshlets->tris[i]];
+        Vector3f* p[3] = { t->v1, t->v2, t->v3 };
+        for (int k = 0; k < 3; k++)
+        {
+            lo.x = fminf(lo.x, p[k]->x); lo.y = fminf(lo.y, p[k]->y); lo.z = fminf(lo.z, p[k]->z);
+            hi.x = fmaxf(hi.x, p[k]->x); hi.y = fmaxf(hi.y, p[k]->y); hi.z = fmaxf(hi.z, p[k]->z);
+        }
+    }
+
+    Vector3f center = { (lo.x+hi.x)*0.5f, (lo.y+hi.y)*0.5f, (lo.z+hi.z)*0.5f };
+    float radius = 0.0f;
+
+    for (int i = first; i < first+count; i++)
+    {
+        Triangle* t = model->triangles[meshlets->tris[i]];
+        Vector3f* p[3] = { t->v1, t->v2, t->v3 };
+        for (int k = 0; k < 3; k++)
+        {
+            float dx = p[k]->x-center.x, dy = p[k]->y-center.y, dz = p[k]->z-center.z;
+            radius = fmaxf(radius, sqrtf(dx*dx + dy*dy + dz*dz));
+        }
+    }
+
+    // Face normals from the winding, since that is what GL_CULL_FACE looks at
+    Vector3f* normals = (Vector3f*) calloc(count, sizeof(Vector3f));
+    int normal_count = 0;
+
+    for (int i = first; i < first+count; i++)
+    {
+        Triangle* t = model->triangles[meshlets->tris[i]];
+        float e1[3] = { t->v2->x-t->v1->x, t->v2->y-t->v1->y, t->v2->z-t->v1->z };
+        float e2[3] = { t->v3->x-t->v1->x, t->v3->y-t->v1->y, t->v3->z-t->v1->z };
+        Vector3f n = { e1[1]*e2[2]-e1[2]*e2[1], e1[2]*e2[0]-e1[0]*e2[2], e1[0]*e2[1]-e1[1]*e2[0] };
+        float len = sqrtf(n.x*n.x + n.y*n.y + n.z*n.z);
+
+        if (len <= 0.0f) { continue; } // degenerate triangles are never drawn anyway
+
+        n.x /= len; n.y /= len; n.z /= len;
+        normals[normal_count++] = n;
+        axis.x += n.x; axis.y += n.y; axis.z += n.z;
+    }
+
+    // The cone's spread is the widest angle between the axis and a normal. A cluster of
+    // back faces is hidden when the angle between the axis and the view direction is less
+    // than 90 degrees minus that spread, i.e. dot(axis, view) > sin(spread).
+    float cutoff = CONE_NEVER_CULL;
+    float axis_len = sqrtf(axis.x*axis.x + axis.y*axis.y + axis.z*axis.z);
+
+    if (axis_len > 0.0f && normal_count > 0)
+    {
+        float min_dot = 1.0f;
+        axis.x /= axis_len; axis.y /= axis_len; axis.z /= axis_len;
+
+        for (int i = 0; i < normal_count; i++)
+        { min_dot = fminf(min_dot, axis.x*normals[i].x + axis.y*normals[i].y + axis.z*normals[i].z); }
+
+        // Cones wider than a hemisphere always have something facing the camera
+        if (min_dot > 0.0f) { cutoff = sqrtf(1.0f - min_dot*min_dot); }
+    }
+
+    meshlets->center_x[m] = center.x;
+    meshlets->center_y[m] = center.y;
+    meshlets->center_z[m] = center.z;
+    meshlets->radius[m] = radius;
+    meshlets->axis_x[m] = axis.x;
+    meshlets->axis_y[m] = axis.y;
+    meshlets->axis_z[m] = axis.z;
+    meshlets->cone_cutoff[m] = cutoff;
+
+    free(normals); normals = NULL;
+}
+
+Meshlets* build_meshlets(Model* model)
+{
+    /* Variables */
+
+    Meshlets* meshlets = NULL;
+    Vector3f* verts[MESHLET_MAX_VERTS]; // unique positions in the current meshlet
+    int vert_count = 0;
+    Vector3f normal_sum = { 0.0f, 0.0f, 0.0f }; // of the current meshlet's face normals
+    int tri_count = model->tri_count;
+    int capacity = 0; // meshlet slots allocated, a multiple of 4 for the SIMD culling loop
+    double start = get_time();
+
+    // error check
+    if (tri_count <= 0) { fprintf(stderr, "Cannot build meshlets without triangles.\n"); return NULL; }
+
+    meshlets = (Meshlets*) calloc(1, sizeof(Meshlets));
+    meshlets->tris = (int*) calloc(tri_count, sizeof(int));
+    meshlets->tri_count_total = tri_count;
+
+    // Worst case every triangle turns away from the last and gets its own meshlet. The
+    // arrays are trimmed once the real count is known.
+    capacity = (tri_count + 3) & ~3;
+
+    meshlets->tri_offset = (int*) calloc(capacity, sizeof(int));
+    meshlets->tri_count = (int*) calloc(capacity, sizeof(int));
+    meshlets->visible = (int*) calloc(capacity, sizeof(int));
+    meshlets->center_x = (float*) calloc(capacity, sizeof(float));
+    meshlets->center_y = (float*) calloc(capacity, sizeof(float));
+    meshlets->center_z = (float*) calloc(capacity, sizeof(float));
+    meshlets->radius = (float*) calloc(capacity, sizeof(float));
+    meshlets->axis_x = (float*) calloc(capacity, sizeof(float));
+    meshlets->axis_y = (float*) calloc(capacity, sizeof(float));
+    meshlets->axis_z = (float*) calloc(capacity, sizeof(float));
+    meshlets->cone_cutoff = (float*) calloc(capacity, sizeof(float));
+
+    /* Greedy clustering */
+
+    // Walk the triangles in BVH leaf order when there is one, which keeps neighbouring
+    // triangles together, and start a new meshlet whenever one would overflow
+    for (int i = 0; i < tri_count; i++)
+    {
+        int index = model->bvh ? model->bvh->tri_index[i] : i;
+        Triangle* t = model->triangles[index];
+        Vector3f* p[3] = { t->v1, t->v2, t->v3 };
+        int m = meshlets->count ? meshlets->count-1 : 0;
+        int new_verts = 0;
+
+        // Face normal, compared with the meshlet's average to keep its cone narrow
+        float e1[3] = { t->v2->x-t->v1->x, t->v2->y-t->v1->y, t->v2->z-t->v1->z };
+        float e2[3] = { t->v3->x-t->v1->x, t->v3->y-t->v1->y, t->v3->z-t->v1->z };
+        Vector3f n = { e1[1]*e2[2]-e1[2]*e2[1], e1[2]*e2[0]-e1[0]*e2[2], e1[0]*e2[1]-e1[1]*e2[0] };
+        float n_len = sqrtf(n.x*n.x + n.y*n.y + n.z*n.z);
+        float sum_len = sqrtf(normal_sum.x*normal_sum.x + normal_sum.y*normal_sum.y + normal_sum.z*normal_sum.z);
+        bool turned = n_len > 0.0f && sum_len > 0.0f &&
+                      (n.x*normal_sum.x + n.y*normal_sum.y + n.z*normal_sum.z) / (n_len*sum_len) < CONE_SPLIT_DOT;
+
+        for (int k = 0; k < 3; k++)
+        {
+            if (find_vertex(verts, vert_count, p[k]) >= 0) { continue; }
+
+            // Triangles that repeat a vertex only count it once
+            bool repeated = FALSE;
+            for (int j = 0; j < k; j++) { if (p[j] == p[k]) { repeated = TRUE; } }
+            if (!repeated) { new_verts++; }
+        }
+
+        if (meshlets->count == 0 ||
+            vert_count + new_verts > MESHLET_MAX_VERTS ||
+            meshlets->tri_count[m] == MESHLET_MAX_TRIS ||
+            turned)
+        {
+            m = meshlets->count++;
+            meshlets->tri_offset[m] = i;
+            meshlets->tri_count[m] = 0;
+            vert_count = 0;
+            normal_sum.x = normal_sum.y = normal_sum.z = 0.0f;
+        }
+
+        if (n_len > 0.0f)
+        { normal_sum.x += n.x/n_len; normal_sum.y += n.y/n_len; normal_sum.z += n.z/n_len; }
+
+        for (int k = 0; k < 3; k++)
+        { if (find_vertex(verts, vert_count, p[k]) < 0) { verts[vert_count++] = p[k]; } }
+
+        meshlets->tris[i] = index;
+        meshlets->tri_count[m]++;
+    }
+
+    capacity = (meshlets->count + 3) & ~3;
+    meshlets->tri_offset = (int*) realloc(meshlets->tri_offset, capacity*sizeof(int));
+    meshlets->tri_count = (int*) realloc(meshlets->tri_count, capacity*sizeof(int));
+    meshlets->visible = (int*) realloc(meshlets->visible, capacity*sizeof(int));
+    meshlets->center_x = (float*) realloc(meshlets->center_x, capacity*sizeof(float));
+    meshlets->center_y = (float*) realloc(meshlets->center_y, capacity*sizeof(float));
+    meshlets->center_z = (float*) realloc(meshlets->center_z, capacity*sizeof(float));
+    meshlets->radius = (float*) realloc(meshlets->radius, capacity*sizeof(float));
+    meshlets->axis_x = (float*) realloc(meshlets->axis_x, capacity*sizeof(float));
+    meshlets->axis_y = (float*) realloc(meshlets->axis_y, capacity*sizeof(float));
+    meshlets->axis_z = (float*) realloc(meshlets->axis_z, capacity*sizeof(float));
+    meshlets->cone_cutoff = (float*) realloc(meshlets->cone_cutoff, capacity*sizeof(float));
+    meshlets->capacity = capacity;
+
+    for (int m = 0; m < meshlets->count; m++) { bound_meshlet(meshlets, model, m); }
+
+    meshlets->build_time = get_time() - start;
+
+    return meshlets;
+}
+
+void free_meshlets(Meshlets* meshlets)
+{
+    if (!meshlets) { return; }
+
+    free(meshlets->tris);
+    free(meshlets->tri_offset);
+    free(meshlets->tri_count);
+    free(meshlets->visible);
+    free(meshlets->center_x);
+    free(meshlets->center_y);
+    free(meshlets->center_z);
+    free(meshlets->radius);
+    free(meshlets->axis_x);
+    free(meshlets->axis_y);
+    free(meshlets->axis_z);
+    free(meshlets->cone_cutoff);
+    free(meshlets);
+}
+
+size_t meshlet_bytes(Meshlets* meshlets)
+{
+    if (!meshlets) { return 0; }
+
+    // Triangle list, then 11 ints/floats per meshlet slot
+    return sizeof(Meshlets) + meshlets->tri_count_total*sizeof(int) +
+           meshlets->capacity*(3*sizeof(int) + 8*sizeof(float));
+}
+
+int cull_meshlets(Scene* scene, Meshlets* meshlets)
+{
+    /* Variables */
+
+    float half_w, half_h, depth = scene->view_area_scale;
+    Vector3f view = { 0.0f, 0.0f, -1.0f };
+    Vector3f mx = { 1.0f, 0.0f, 0.0f }, my = { 0.0f, 1.0f, 0.0f }, mz = { 0.0f, 0.0f, 1.0f };
+    int visible = 0, backface = 0, frustum = 0, tris = 0;
+
+    // View direction in model space, and the model to eye rotation as three columns
+    get_view_extents(scene, &half_w, &half_h);
+    eye_to_model(&view);
+    model_to_eye(&mx);
+    model_to_eye(&my);
+    model_to_eye(&mz);
+
+    /* Test 4 clusters at a time */
+
+    for (int m = 0; m < meshlets->count; m += 4)
+    {
+        int back_mask = 0, out_mask = 0;
+
+#ifdef __SSE__
+        __m128 cx = _mm_loadu_ps(&meshlets->center_x[m]);
+        __m128 cy = _mm_loadu_ps(&meshlets->center_y[m]);
+        __m128 cz = _mm_loadu_ps(&meshlets->center_z[m]);
+        __m128 r = _mm_loadu_ps(&meshlets->radius[m]);
+        __m128 sign = _mm_set1_ps(-0.0f);
+
+        // Backface: dot(axis, view) > cutoff
+        __m128 dot = _mm_add_ps(_mm_add_ps(
+                     _mm_mul_ps(_mm_loadu_ps(&meshlets->axis_x[m]), _mm_set1_ps(view.x)),
+                     _mm_mul_ps(_mm_loadu_ps(&meshlets->axis_y[m]), _mm_set1_ps(view.y))),
+                     _mm_mul_ps(_mm_loadu_ps(&meshlets->axis_z[m]), _mm_set1_ps(view.z)));
+        back_mask = _mm_movemask_ps(_mm_cmpgt_ps(dot, _mm_loadu_ps(&meshlets->cone_cutoff[m])));
+
+        // Outside the view: |eye space center| > extent + radius on any axis
+        __m128 ex = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(mx.x)),
+                    _mm_mul_ps(cy, _mm_set1_ps(my.x))), _mm_mul_ps(cz, _mm_set1_ps(mz.x)));
+        __m128 ey = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(mx.y)),
+                    _mm_mul_ps(cy, _mm_set1_ps(my.y))), _mm_mul_ps(cz, _mm_set1_ps(mz.y)));
+        __m128 ez = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(mx.z)),
+                    _mm_mul_ps(cy, _mm_set1_ps(my.z))), _mm_mul_ps(cz, _mm_set1_ps(mz.z)));
+
+        __m128 out = _mm_or_ps(_mm_or_ps(
+                     _mm_cmpgt_ps(_mm_andnot_ps(sign, ex), _mm_add_ps(_mm_set1_ps(half_w), r)),
+                     _mm_cmpgt_ps(_mm_andnot_ps(sign, ey), _mm_add_ps(_mm_set1_ps(half_h), r))),
+                     _mm_cmpgt_ps(_mm_andnot_ps(sign, ez), _mm_add_ps(_mm_set1_ps(depth), r)));
+        out_mask = _mm_movemask_ps(out);
+#else
+        // Same backface and view tests as above, one meshlet at a time
+        for (int i = 0; i < 4; i++)
+        {
+            float cx = meshlets->center_x[m+i], cy = meshlets->center_y[m+i], cz = meshlets->center_z[m+i];
+            float r = meshlets->radius[m+i];
+            float dot = meshlets->axis_x[m+i]*view.x + meshlets->axis_y[m+i]*view.y +
+                        meshlets->axis_z[m+i]*view.z;
+            float ex = cx*mx.x + cy*my.x + cz*mz.x;
+            float ey = cx*mx.y + cy*my.y + cz*mz.y;
+            float ez = cx*mx.z + cy*my.z + cz*mz.z;
+
+            if (dot > meshlets->cone_cutoff[m+i]) { back_mask |= 1 << i; }
+            if (fabsf(ex) > half_w+r || fabsf(ey) > half_h+r || fabsf(ez) > depth+r)
+            { out_mask |= 1 << i; }
+        }
+#endif
+
+        // Padding slots past the last meshlet are ignored
+        for (int i = 0; i < 4 && m+i < meshlets->count; i++)
+        {
+            if (back_mask & (1 << i)) { backface++; }
+            else if (out_mask & (1 << i)) { frustum++; }
+            else
+            {
+                meshlets->visible[visible++] = m+i;
+                tris += meshlets->tri_count[m+i];
+            }
+        }
+    }
+
+    meshlets->visible_count = visible;
+    meshlets->backface_culled = backface;
+    meshlets->frustum_culled = frustum;
+    meshlets->tris_submitted = tris;
+
+    return visible;
+}
+
+void print_meshlet_stats(Meshlets* meshlets)
+{
+    printf("Meshlets: %d of %d drawn, %d culled as back facing, %d outside the view\n",
+           meshlets->visible_count, meshlets->count, meshlets->backface_culled, meshlets->frustum_culled);
+    printf("Triangles: %d of %d submitted (%.1f%% saved)\n",
+           meshlets->tris_submitted, meshlets->tri_count_total,
+           100.0 * (meshlets->tri_count_total - meshlets->tris_submitted) / meshlets->tri_count_total);
+}
+
+int bench_meshlets(Model* model, float scale)
+{
+    /* Variables */
+
+    Scene scene;
+    Meshlets* meshlets = NULL;
+    long backface = 0, frustum = 0, tris = 0;
+    int frames = BENCH_YAW_STEPS*BENCH_PITCH_STEPS;
+    double cull_time = 0;
+
+    memset(&scene, 0, sizeof(Scene));
+    scene.view_area_scale = scale;
+    scene.model_count = 1;
+    scene.models = &model;
+
+    // No window in benchmark mode, so assume the default size
+    if (window_width <= 0 || window_height <= 0)
+    { window_width = DEF_WIN_WIDTH; window_height = DEF_WIN_HEIGHT; }
+
+    // Clusters follow the BVH's leaf order
+    model->bvh = build_bvh(model);
+    meshlets = build_meshlets(model);
+    if (!meshlets) { return ERR; }
+
+    printf("Meshlets: %d clusters over %d triangles, built in %.2f ms\n",
+           meshlets->count, model->tri_count, meshlets->build_time*1000.0);
+
+    /* Sweep the camera around the model */
+
+    for (int y = 0; y < BENCH_YAW_STEPS; y++)
+    {
+        for (int p = 0; p < BENCH_PITCH_STEPS; p++)
+        {
+            camera_xRot = y * 360.0f / BENCH_YAW_STEPS;
+            camera_yRot = p * 360.0f / BENCH_PITCH_STEPS;
+
+            double start = get_time();
+            cull_meshlets(&scene, meshlets);
+            cull_time += get_time() - start;
+
+            backface += meshlets->backface_culled;
+            frustum += meshlets->frustum_culled;
+            tris += meshlets->tris_submitted;
+        }
+    }
+
+    printf("Over %d views: %.1f back facing and %.1f outside the view culled per frame (%.1f%% of clusters)\n",
+           frames, (double) backface/frames, (double) frustum/frames,
+           100.0 * (backface+frustum) / ((double) frames*meshlets->count));
+    printf("Triangles submitted: %.1f of %d per frame (%.1f%% saved), culling %.2f us per frame\n",
+           (double) tris/frames, model->tri_count,
+           100.0 * (1.0 - (double) tris / ((double) frames*model->tri_count)),
+           cull_time / frames * 1e6);
+
+    /* Garbage Collection */
+
+    free_meshlets(meshlets); meshlets = NULL;
+    free_bvh(model->bvh); model->bvh = NULL;
+
+    return NOERR;
+}
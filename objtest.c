@@ -2,12 +2,30 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#ifdef __APPLE__
 #include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
 #include <GLFW/glfw3.h>
 
 #include "objtest.h"
 
+/* 
+ * Global variables 
+ * Declared in objtest.h
+ */
+
+bool window_size_changed;
+int window_width, window_height;
+float camera_xRot, camera_yRot;
+size_t chunk_budget;
+
+static int write_profile(FILE* out, Scene* scene);
+
 /* 
  * PROGRAM: objtest
  * PURPOSE: Load an arbitrary OBJ model file and render it in a scene
@@ -30,21 +48,126 @@ int main(int argc, char** argv)
     char* obj_file = "monkey.obj"; // Suzanne is a better default as we use vertex lighting
     char* tex_file = "tex.tga";
     float scale = 2.5f;
+    bool bench_mode = FALSE;
+    bool bench_meshlet_mode = FALSE;
+    char* chunk_out = NULL; // set by --preprocess
+    char* profile_out = NULL; // set by --profile-json, "-" for stdout
+    FILE* profile_file = NULL;
+    bool no_window = FALSE;
+    char* batch_list = NULL; // set by --batch
+    char* batch_out = ".";
+    int thumb_size = DEF_THUMB_SIZE, thumb_angles = DEF_THUMB_ANGLES, threads = cpu_count();
+    int positional = 0;
+
+    chunk_budget = (size_t) DEF_CHUNK_BUDGET_MB*1024*1024;
+
+    // Set the model files and scale to the command line input if we received any.
+    // Options start with "--" and may appear anywhere, everything else is positional.
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--bench-bvh") == STR_EQUAL)
+        { bench_mode = TRUE; }
+        else if (strcmp(argv[i], "--bench-meshlets") == STR_EQUAL)
+        { bench_meshlet_mode = TRUE; }
+        else if (strcmp(argv[i], "--preprocess") == STR_EQUAL && i+1 < argc)
+        { chunk_out = argv[++i]; }
+        else if (strcmp(argv[i], "--profile-json") == STR_EQUAL && i+1 < argc)
+        { profile_out = argv[++i]; }
+        else if (strcmp(argv[i], "--no-window") == STR_EQUAL)
+        { no_window = TRUE; }
+        else if (strcmp(argv[i], "--batch") == STR_EQUAL && i+1 < argc)
+        { batch_list = argv[++i]; }
+        else if (strcmp(argv[i], "--out") == STR_EQUAL && i+1 < argc)
+        { batch_out = argv[++i]; }
+        else if (strcmp(argv[i], "--size") == STR_EQUAL && i+1 < argc)
+        { thumb_size = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "--angles") == STR_EQUAL && i+1 < argc)
+        { thumb_angles = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "--threads") == STR_EQUAL && i+1 < argc)
+        { threads = atoi(argv[++i]); }
+        else if (strcmp(argv[i], "--mem-cap") == STR_EQUAL && i+1 < argc)
+        { chunk_budget = (size_t) (atof(argv[++i])*1024*1024); }
+        else if (strncmp(argv[i], "--", 2) == STR_EQUAL)
+        { fprintf(stderr, "Unknown option %s\n", argv[i]); return ERR; }
+        else if (positional == 0)
+        { obj_file = argv[i]; positional++; }
+        else if (positional == 1)
+        { tex_file = argv[i]; positional++; }
+        else if (positional == 2)
+        { scale = atof(argv[i]); positional++; }
+    }
+
+    // Preprocessing loads nothing to profile, and a windowless run only exists to profile
+    if (profile_out && chunk_out)
+    { fprintf(stderr, "--profile-json is not supported with --preprocess.\n"); return ERR; }
+    if (no_window && !profile_out)
+    { fprintf(stderr, "--no-window needs --profile-json.\n"); return ERR; }
 
-    // Set the model files and scale to the command line input if we received any
-    if (argc > 1)
-    { obj_file = argv[1]; }
+    // Open the profile output up front so a bad path fails before anything is loaded
+    if (profile_out)
+    {
+        profile_file = strcmp(profile_out, "-") == STR_EQUAL ? stdout : fopen(profile_out, "w");
+        if (!profile_file) { fprintf(stderr, "Could not open %s\n", profile_out); return ERR; }
+    }
 
-    if (argc > 2)
-    { tex_file = argv[2]; }
+    /* Benchmark mode */
+
+    // Loading an OBJ does not touch OpenGL so no window is needed
+    if (bench_mode || bench_meshlet_mode)
+    {
+        Model* model = load_obj(obj_file);
+        if (!model) { fprintf(stderr, "Could not load model %s\n", obj_file); return ERR; }
+        if (bench_mode && bench_bvh(model, BENCH_RAY_COUNT) < NOERR) { return ERR; }
+        if (bench_meshlet_mode && bench_meshlets(model, scale) < NOERR) { return ERR; }
+
+        if (profile_file)
+        {
+            Scene bench_scene;
+            memset(&bench_scene, 0, sizeof(Scene));
+            bench_scene.models = &model;
+            bench_scene.model_count = 1;
+            bench_scene.view_area_scale = scale;
+            return write_profile(profile_file, &bench_scene);
+        }
+        return NOERR;
+    }
+
+    /* Batch thumbnail mode */
+
+    // Rendered in software, so this runs without a window, OpenGL context or GPU
+    if (batch_list)
+    {
+        int ret = render_batch(batch_list, batch_out, thumb_size, thumb_angles, threads, profile_file);
+        if (profile_file && profile_file != stdout) { fclose(profile_file); }
+        return ret;
+    }
 
-    if (argc > 3)
-    { scale = atof(argv[3]); }
+    /* Preprocessing mode */
+
+    // Split an OBJ that may not fit in memory into a chunk file, which can then be
+    // rendered by passing it in place of the OBJ
+    if (chunk_out)
+    { return preprocess_obj(obj_file, chunk_out, chunk_budget); }
+
+    /* Profiling mode */
+
+    // Loads the scene without a window or OpenGL context, for machines without a display
+    if (no_window)
+    {
+        scene = load_scene(obj_file, tex_file, scale, FALSE);
+        if (!scene) { fprintf(stderr, "Could not load 3D scene.\n"); return ERR; }
+        return write_profile(profile_file, scene);
+    }
 
     /* Window and OpenGL context creation */
 
     // Initialize the GLFW + error checking
-    if (!glfwInit()) { fprintf(stderr, "Could not init window system.\n"); return ERR; }
+    if (!glfwInit())
+    {
+        fprintf(stderr, "Could not init window system.%s\n",
+                profile_file ? " Use --no-window to profile without a display." : "");
+        return ERR;
+    }
     
     // Set OpenGL version to at least 2.1
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
@@ -57,13 +180,19 @@ int main(int argc, char** argv)
     
     // error check window
     if (!window) 
-    { fprintf(stderr, "Could not init window.\n"); glfwTerminate(); return ERR; }
+    {
+        fprintf(stderr, "Could not init window.%s\n",
+                profile_file ? " Use --no-window to profile without a display." : "");
+        glfwTerminate();
+        return ERR;
+    }
 
     // Create OpenGL context
     glfwMakeContextCurrent(window);
 
     // Set window callbacks
     glfwSetKeyCallback(window, key_callback);
+    glfwSetMouseButtonCallback(window, mouse_button_callback);
     glfwSetWindowSizeCallback(window, window_size_callback);
     glfwSetInputMode(window, GLFW_STICKY_KEYS, 1);
     window_size_callback(window, DEF_WIN_WIDTH, DEF_WIN_HEIGHT);
@@ -76,6 +205,12 @@ int main(int argc, char** argv)
     // Error check
     if (!scene) 
     { fprintf(stderr, "Could not init 3D scene.\n"); glfwTerminate(); return ERR; }
+
+    // Let callbacks find the scene without another global
+    glfwSetWindowUserPointer(window, scene);
+
+    // Dump memory use and load timings if asked
+    if (profile_file) { write_profile(profile_file, scene); }
     
     /* Render scene loop */
 
@@ -98,40 +233,12 @@ int main(int argc, char** argv)
 
 Scene* init_scene(Scene* scene, char* model_filename, char* texture_filename, float scale)
 {
-    /* Variables */
-
-    Model* model = NULL;
-    Texture* texture = NULL;
-    Model** models = calloc(1, sizeof(Model*));
-
     /* Load model and texture */
 
-    model = load_obj (model_filename);
-    texture = load_tex (texture_filename);
+    scene = load_scene(model_filename, texture_filename, scale, TRUE);
+    if (!scene) { return NULL; }
 
-    // Error checking
-    if (!model) 
-    { fprintf(stderr, "Could not load model %s\n", model_filename); return NULL; }
-    if (!texture) 
-    { fprintf(stderr, "Could not load texture.%s\n", texture_filename); return NULL; }
-
-    // Assign the texture to the model + error checking
-    if (assign_tex(model, texture) < NOERR)
-    { fprintf(stderr, "WARNING: Model %s does not use a texture.\n", model_filename); }
-
-    models[0] = model;
-
-    /* Scene initialization */
-
-    scene = (Scene*) calloc(1, sizeof(Scene));
-
-    scene->view_area_scale = scale;
     window_size_changed = TRUE;
-
-    scene->model_count = 1; // Could expand the program to render an arbitrary number of
-                            // models fairly easily
-    scene->models = models;
-
     camera_xRot = 0;
     camera_yRot = 0;
 
@@ -158,24 +265,127 @@ Scene* init_scene(Scene* scene, char* model_filename, char* texture_filename, fl
     glEnable(GL_LIGHT0);
 
     // These arrays should be stored in a Light struct instead
-    float ambient[] = { 0.5f, 0.5f, 0.5f, 1.0f };
+    float ambient[] = LIGHT_AMBIENT;
     glLightfv(GL_LIGHT0, GL_AMBIENT, ambient);
-    float diffuse[] = { 3.0f, 3.0f, 3.0f, 1.0f };
+    float diffuse[] = LIGHT_DIFFUSE;
     glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuse);
-    float specular[] = { 0.2f, 0.2f, 0.2f, 0.2f };
+    float specular[] = LIGHT_SPECULAR;
     glLightfv(GL_LIGHT0, GL_SPECULAR, specular);
-    float position[] = { 1.0f, 1.5f, 1.0f, 1.0f };
+    float position[] = LIGHT_POSITION;
     glLightfv(GL_LIGHT0, GL_POSITION, position);
 
     return scene;
 }
 
+Scene* load_scene(char* model_filename, char* texture_filename, float scale, bool upload)
+{
+    /* Variables */
+
+    Scene* scene = NULL;
+    Model* model = NULL;
+    Texture* texture = NULL;
+    Model** models = calloc(1, sizeof(Model*));
+    ChunkedModel* chunked = NULL;
+    size_t name_length = strlen(model_filename);
+    size_t ext_length = strlen(CHUNK_EXTENSION);
+
+    /* Load model and texture */
+
+    // Chunk files are opened for paging instead of being loaded whole
+    if (name_length > ext_length &&
+        strcmp(model_filename + name_length - ext_length, CHUNK_EXTENSION) == STR_EQUAL)
+    { chunked = open_chunked(model_filename, chunk_budget); }
+    else
+    { model = load_obj (model_filename); }
+    texture = upload ? load_tex (texture_filename) : read_tex (texture_filename);
+
+    // Error checking
+    if (!model && !chunked) 
+    { fprintf(stderr, "Could not load model %s\n", model_filename); return NULL; }
+    if (!texture) 
+    { fprintf(stderr, "Could not load texture.%s\n", texture_filename); return NULL; }
+
+    if (chunked)
+    {
+        if (chunked->textured) { chunked->texture = texture; }
+        else { fprintf(stderr, "WARNING: Model %s does not use a texture.\n", model_filename); }
+    }
+    else
+    {
+        // Assign the texture to the model + error checking
+        if (assign_tex(model, texture) < NOERR)
+        { fprintf(stderr, "WARNING: Model %s does not use a texture.\n", model_filename); }
+
+        // Build the BVH used for picking. Rendering works without it.
+        model->bvh = build_bvh(model);
+        if (!model->bvh)
+        { fprintf(stderr, "WARNING: Could not build BVH for %s, picking disabled.\n", model_filename); }
+        else
+        { add_to_profile(model, PHASE_BUILD, model->bvh->build_time, MEM_BVH, bvh_bytes(model->bvh)); }
+
+        // Cluster the model for culling, following the BVH's leaf order
+        model->meshlets = build_meshlets(model);
+        if (model->meshlets)
+        {
+            size_t index_bytes = model->meshlets->tri_count_total*sizeof(int);
+            add_to_profile(model, PHASE_BUILD, model->meshlets->build_time, MEM_INDICES, index_bytes);
+            add_to_profile(model, PHASE_BUILD, 0, MEM_BOOKKEEPING, meshlet_bytes(model->meshlets) - index_bytes);
+        }
+
+        models[0] = model;
+    }
+
+    /* Scene initialization */
+
+    scene = (Scene*) calloc(1, sizeof(Scene));
+
+    scene->view_area_scale = scale;
+    scene->model_count = model ? 1 : 0; // Could expand the program to render an arbitrary
+                                        // number of models fairly easily
+    scene->models = models;
+    scene->chunked = chunked;
+    scene->texture = texture;
+
+    return scene;
+}
+
+// Writes a scene's profile JSON to the file opened for --profile-json, then closes it
+static int write_profile(FILE* out, Scene* scene)
+{
+    int ret = dump_profile_json(scene, out);
+
+    if (ret < NOERR) { fprintf(stderr, "Could not write profile.\n"); }
+    if (out != stdout) { fclose(out); }
+
+    return ret;
+}
+
+// Sends one triangle's vertices, normals and (if textured) UV coordinates to OpenGL
+static void draw_triangle(Model* model, Triangle* tri)
+{
+    if (model->textured)
+    { glTexCoord2f(tri->u1->x, tri->u1->y); }
+    glNormal3f(tri->n1->x, tri->n1->y, tri->n1->z);
+    glVertex3f(tri->v1->x, tri->v1->y, tri->v1->z);
+
+    if (model->textured)
+    { glTexCoord2f(tri->u2->x, tri->u2->y); }
+    glNormal3f(tri->n2->x, tri->n2->y, tri->n2->z);
+    glVertex3f(tri->v2->x, tri->v2->y, tri->v2->z);
+
+    if (model->textured)
+    { glTexCoord2f(tri->u3->x, tri->u3->y); }
+    glNormal3f(tri->n3->x, tri->n3->y, tri->n3->z);
+    glVertex3f(tri->v3->x, tri->v3->y, tri->v3->z);
+}
+
 void render_scene(Scene* scene)
 {
     // Check for changes to the window size and dynamically scale
     if (window_size_changed)
     {
         GLfloat nRange = scene->view_area_scale;
+        GLfloat half_w, half_h;
         int w = window_width;
         int h = window_height;
 
@@ -186,10 +396,8 @@ void render_scene(Scene* scene)
         glMatrixMode(GL_PROJECTION);
         glLoadIdentity();
 
-        if (w <= h)
-        { glOrtho (-nRange, nRange, -nRange*h/w, nRange*h/w, -nRange, nRange); }
-        else
-        { glOrtho (-nRange*w/h, nRange*w/h, -nRange, nRange, -nRange, nRange); }
+        get_view_extents(scene, &half_w, &half_h);
+        glOrtho (-half_w, half_w, -half_h, half_h, -nRange, nRange);
 
         glMatrixMode(GL_MODELVIEW);
         glLoadIdentity();
@@ -210,28 +418,35 @@ void render_scene(Scene* scene)
     // Render models
     for (int i = 0; i < scene->model_count; i++)
     {
-        Triangle** modelTris = scene->models[i]->triangles;
+        Model* model = scene->models[i];
+        Triangle** modelTris = model->triangles;
+        Meshlets* meshlets = model->meshlets;
 
-        if (scene->models[i]->textured)
-        { glBindTexture(GL_TEXTURE_2D, *(scene->models[i]->texture)); }
+        if (model->textured)
+        { glBindTexture(GL_TEXTURE_2D, *(model->texture)); }
 
-        glBegin(GL_TRIANGLES); for (int j = 0; j < scene->models[i]->tri_count; j++)
+        glBegin(GL_TRIANGLES);
+        if (meshlets)
         {
-            if (scene->models[i]->textured)
-            { glTexCoord2f(modelTris[j]->u1->x, modelTris[j]->u1->y); }
-            glNormal3f(modelTris[j]->n1->x, modelTris[j]->n1->y, modelTris[j]->n1->z);
-            glVertex3f(modelTris[j]->v1->x, modelTris[j]->v1->y, modelTris[j]->v1->z);
-            
-            if (scene->models[i]->textured)
-            { glTexCoord2f(modelTris[j]->u2->x, modelTris[j]->u2->y); }
-            glNormal3f(modelTris[j]->n2->x, modelTris[j]->n2->y, modelTris[j]->n2->z);
-            glVertex3f(modelTris[j]->v2->x, modelTris[j]->v2->y, modelTris[j]->v2->z);
-            
-            if (scene->models[i]->textured)
-            { glTexCoord2f(modelTris[j]->u3->x, modelTris[j]->u3->y); }
-            glNormal3f(modelTris[j]->n3->x, modelTris[j]->n3->y, modelTris[j]->n3->z);
-            glVertex3f(modelTris[j]->v3->x, modelTris[j]->v3->y, modelTris[j]->v3->z);
-        } glEnd();
+            // Only submit clusters that can have a front facing triangle in view
+            cull_meshlets(scene, meshlets);
+            for (int k = 0; k < meshlets->visible_count; k++)
+            {
+                int m = meshlets->visible[k];
+                for (int j = meshlets->tri_offset[m]; j < meshlets->tri_offset[m]+meshlets->tri_count[m]; j++)
+                { draw_triangle(model, modelTris[meshlets->tris[j]]); }
+            }
+        }
+        else
+        { for (int j = 0; j < model->tri_count; j++) { draw_triangle(model, modelTris[j]); } }
+        glEnd();
+    }
+
+    // Render whichever chunks of an out-of-core model are visible and resident
+    if (scene->chunked)
+    {
+        page_chunks(scene, scene->chunked);
+        render_chunks(scene->chunked);
     }
 
     glPopMatrix();
@@ -249,6 +464,60 @@ void key_callback (GLFWwindow* window, int key, int scancode, int action, int mo
     { camera_xRot -= 2; }
     else if (key == GLFW_KEY_RIGHT && (action == GLFW_PRESS || action == GLFW_REPEAT))
     { camera_xRot += 2; }
+
+    // Print culling and paging statistics for the last frame
+    if (key == GLFW_KEY_S && action == GLFW_PRESS)
+    {
+        Scene* scene = (Scene*) glfwGetWindowUserPointer(window);
+        if (!scene) { return; }
+
+        for (int i = 0; i < scene->model_count; i++)
+        { if (scene->models[i]->meshlets) { print_meshlet_stats(scene->models[i]->meshlets); } }
+        if (scene->chunked) { print_chunk_stats(scene->chunked); }
+    }
+}
+
+void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
+{
+    Scene* scene = (Scene*) glfwGetWindowUserPointer(window);
+    double cursor_x, cursor_y;
+    float half_w, half_h;
+
+    if (!scene || button != GLFW_MOUSE_BUTTON_LEFT || action != GLFW_PRESS) { return; }
+    if (window_width <= 0 || window_height <= 0) { return; }
+
+    // Map the cursor onto the near plane of the orthographic view volume
+    glfwGetCursorPos(window, &cursor_x, &cursor_y);
+    get_view_extents(scene, &half_w, &half_h);
+
+    Vector3f origin = { (2.0f*cursor_x/window_width - 1.0f) * half_w,
+                        (1.0f - 2.0f*cursor_y/window_height) * half_h,
+                        scene->view_area_scale };
+    Vector3f dir = { 0.0f, 0.0f, -1.0f };
+
+    // Models are drawn with the camera rotation applied, so undo it to cast in model space
+    eye_to_model(&origin);
+    eye_to_model(&dir);
+
+    // Pick the closest triangle across all models
+    int picked_model = -1;
+    Hit best;
+    best.t = 2.0f * scene->view_area_scale;
+
+    for (int i = 0; i < scene->model_count; i++)
+    {
+        Ray ray;
+        Hit hit;
+
+        init_ray(&ray, origin, dir, best.t);
+        if (bvh_closest_hit(scene->models[i]->bvh, &ray, &hit))
+        { best = hit; picked_model = i; }
+    }
+
+    if (picked_model >= 0)
+    { printf("Picked triangle %d of model %d\n", best.tri_index, picked_model); }
+    else
+    { printf("Picked nothing\n"); }
 }
 
 void window_size_callback(GLFWwindow* window, int w, int h) 
@@ -257,4 +526,75 @@ void window_size_callback(GLFWwindow* window, int w, int h)
     window_size_changed = TRUE;
     window_width = w;
     window_height = h;
+}
+
+void get_view_extents(Scene* scene, float* half_w, float* half_h)
+{
+    view_extents(scene->view_area_scale, window_width, window_height, half_w, half_h);
+}
+
+void view_extents(float scale, int w, int h, float* half_w, float* half_h)
+{
+    float nRange = scale;
+
+    if (h <= 0) { h = 1; }
+    if (w <= 0) { w = 1; }
+
+    // The shorter side of the viewport always spans the view scale
+    if (w <= h) { *half_w = nRange; *half_h = nRange*h/w; }
+    else { *half_w = nRange*w/h; *half_h = nRange; }
+}
+
+void model_to_eye(Vector3f* v)
+{
+    rotate_to_eye(v, camera_xRot, camera_yRot);
+}
+
+void eye_to_model(Vector3f* v)
+{
+    rotate_to_model(v, camera_xRot, camera_yRot);
+}
+
+void rotate_to_eye(Vector3f* v, float xRot, float yRot)
+{
+    // Same order as render_scene: glRotatef about Y by xRot, then about X by yRot, so the
+    // X rotation is applied to the vector first
+    float a = xRot * M_PI / 180.0f;
+    float b = yRot * M_PI / 180.0f;
+    float x = v->x, y = v->y, z = v->z;
+
+    float y1 = cosf(b)*y - sinf(b)*z;
+    float z1 = sinf(b)*y + cosf(b)*z;
+
+    v->x = cosf(a)*x + sinf(a)*z1;
+    v->y = y1;
+    v->z = -sinf(a)*x + cosf(a)*z1;
+}
+
+void rotate_to_model(Vector3f* v, float xRot, float yRot)
+{
+    // Inverse of rotate_to_eye: undo the Y rotation, then the X rotation
+    float a = xRot * M_PI / 180.0f;
+    float b = yRot * M_PI / 180.0f;
+    float x = v->x, y = v->y, z = v->z;
+
+    float x1 = cosf(a)*x - sinf(a)*z;
+    float z1 = sinf(a)*x + cosf(a)*z;
+
+    v->x = x1;
+    v->y = cosf(b)*y + sinf(b)*z1;
+    v->z = -sinf(b)*y + cosf(b)*z1;
+}
+
+double get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int) count : 1;
 }
\ No newline at end of file
@@ -1,7 +1,11 @@
 #ifndef OBJTEST_H
 #define OBJTEST_H
 
+#ifdef __APPLE__
 #include "OpenGL/gl.h"
+#else
+#include "GL/gl.h"
+#endif
 
 /* Magic Numbers */
 
@@ -9,6 +13,35 @@
 #define DEF_WIN_WIDTH 640
 #define DEF_WIN_HEIGHT 480
 
+// Rays cast by --bench-bvh
+#define BENCH_RAY_COUNT 1000000
+
+// Out-of-core chunk files
+#define CHUNK_EXTENSION ".chunks"
+#define CHUNK_GRID 8 // chunks per axis before oversized chunks are split
+#define CHUNK_FRACTION 8 // chunks are at most this fraction of the memory cap
+#define DEF_CHUNK_BUDGET_MB 256 // default --mem-cap
+#define MIN_CHUNK_BUDGET (1024*1024)
+
+// Meshlet limits
+#define MESHLET_MAX_VERTS 64
+#define MESHLET_MAX_TRIS 124
+
+// Fixed function lighting, shared by init_scene and the software thumbnail renderer
+#define LIGHT_AMBIENT { 0.5f, 0.5f, 0.5f, 1.0f }
+#define LIGHT_DIFFUSE { 3.0f, 3.0f, 3.0f, 1.0f }
+#define LIGHT_SPECULAR { 0.2f, 0.2f, 0.2f, 0.2f }
+#define LIGHT_POSITION { 1.0f, 1.5f, 1.0f, 1.0f } // eye space
+
+// Headless thumbnail rendering defaults
+#define DEF_THUMB_SIZE 256
+#define DEF_THUMB_ANGLES 8
+#define DEF_THUMB_PITCH 20.0f // degrees
+#define DEF_THUMB_SCALE 2.5f
+
+// Longest asset name kept in a load profile
+#define PROFILE_NAME_SIZE 256
+
 // Return codes
 #define NOERR  0
 #define ERR   -1
@@ -22,6 +55,16 @@
 // String comparison
 #define STR_EQUAL 0
 
+// Bounding volume hierarchy parameters
+#define BVH_WIDTH 4 // children per node, one SSE register of floats
+#define BVH_BINS 16 // SAH bins per axis during construction
+#define BVH_LEAF_SIZE 4 // nodes this small always become leaves (SAH may allow up to 2x)
+#define BVH_PARALLEL_MIN 4096 // min triangles in a subtree before spawning a build thread
+#define BVH_STACK_SIZE 256 // traversal stack depth
+// Deeper nodes get median splits, adding at most 31 more levels. Traversal pushes at most
+// BVH_WIDTH-1 nodes per level, so (48+31)*3+1 entries always fit in BVH_STACK_SIZE.
+#define BVH_MAX_DEPTH 48
+
 /* Structure Declarations */
 
 struct vector2f;
@@ -29,6 +72,15 @@ struct vector3f;
 struct model;
 struct scene;
 struct triangle;
+struct ray;
+struct hit;
+struct bvh_node;
+struct bvh;
+struct chunk;
+struct chunked_model;
+struct load_profile;
+struct meshlets;
+struct image;
 
 // To use _t or to not use _t?
 typedef struct vector2f Vector2f;
@@ -36,6 +88,41 @@ typedef struct vector3f Vector3f;
 typedef struct model Model;
 typedef struct scene Scene;
 typedef struct triangle Triangle;
+typedef struct ray Ray;
+typedef struct hit Hit;
+typedef struct bvh_node BVH_Node;
+typedef struct bvh BVH;
+typedef struct chunk Chunk;
+typedef struct chunked_model ChunkedModel;
+typedef struct load_profile LoadProfile;
+typedef struct meshlets Meshlets;
+typedef struct image Image;
+
+/* Enumerations */
+
+// What memory is used for, for accounting
+typedef enum mem_category
+{
+	MEM_POSITIONS,
+	MEM_UVS,
+	MEM_NORMALS,
+	MEM_INDICES,
+	MEM_TEXTURE_LEVELS,
+	MEM_BVH,
+	MEM_BOOKKEEPING,
+	MEM_CATEGORY_COUNT
+} MemCategory;
+
+// Phases of loading an asset, for profiling
+typedef enum load_phase
+{
+	PHASE_IO,
+	PHASE_TOKENIZE,
+	PHASE_PARSE,
+	PHASE_BUILD,
+	PHASE_UPLOAD,
+	PHASE_COUNT
+} LoadPhase;
 //typedef struct texture Texture;
 typedef GLuint Texture; // cheat for demonstration purposes
 
@@ -44,26 +131,124 @@ typedef GLuint Texture; // cheat for demonstration purposes
  * Nasty and should be avoided.
  */
 
-bool window_size_changed;
-int window_width, window_height;
-float camera_xRot, camera_yRot;
+extern bool window_size_changed;
+extern int window_width, window_height;
+extern float camera_xRot, camera_yRot;
+extern size_t chunk_budget; // bytes of chunk data allowed in memory, set by --mem-cap
 
 /* Functions */
 
 // Defined in: objtest.c
 extern Scene* init_scene(Scene* scene, 
 						 char* model_filename, char* texture_filename, float scale);
+// load_scene loads a Scene's assets without setting up OpenGL. Textures are only uploaded
+// if upload is set, which needs a current context.
+extern Scene* load_scene(char* model_filename, char* texture_filename, float scale, bool upload);
 extern void render_scene(Scene* scene);
 extern void key_callback (GLFWwindow* window, int key, int scancode, int action, int mods);
+extern void mouse_button_callback(GLFWwindow* window, int button, int action, int mods);
 extern void window_size_callback(GLFWwindow* window, int w, int h);
+// get_view_extents returns the half width and half height of the orthographic view volume,
+// view_extents does the same for any scale and viewport size
+extern void get_view_extents(Scene* scene, float* half_w, float* half_h);
+extern void view_extents(float scale, int w, int h, float* half_w, float* half_h);
+// eye_to_model/model_to_eye apply the camera rotation (or its inverse) to a vector,
+// rotate_to_eye/rotate_to_model do the same for any pair of angles
+extern void eye_to_model(Vector3f* v);
+extern void model_to_eye(Vector3f* v);
+extern void rotate_to_eye(Vector3f* v, float xRot, float yRot);
+extern void rotate_to_model(Vector3f* v, float xRot, float yRot);
+// get_time returns a monotonic time in seconds, cpu_count the number of online CPUs
+extern double get_time(void);
+extern int cpu_count(void);
 
 // Defined in: file_loaders.c
 // load_tex reads a TGA file and returns a Texture (OpenGL texture ID)
 extern Texture* load_tex(char* filename);
+// read_tex accounts for a texture like load_tex but without OpenGL, returning texture 0
+extern Texture* read_tex(char* filename);
 // load_obj reads an OBJ file and returns a Model object
 extern Model* load_obj(char* filename);
 // assign_tex pairs a Model with a Texture
 extern int assign_tex(Model* model, Texture* tex);
+// free_model frees a Model and everything built for it, except its texture
+extern void free_model(Model* model);
+// read_tga reads a TGA file's pixels without involving OpenGL, write_tga writes one
+extern Image* read_tga(char* filename, LoadProfile* profile);
+extern int write_tga(char* filename, Image* image);
+extern void free_image(Image* image);
+
+// Defined in: bvh.c
+// build_bvh builds a 4-wide BVH over a Model's triangles using binned SAH
+extern BVH* build_bvh(Model* model);
+extern void free_bvh(BVH* bvh);
+extern size_t bvh_bytes(BVH* bvh);
+// init_ray fills in a Ray and precomputes its inverse direction
+extern void init_ray(Ray* ray, Vector3f origin, Vector3f dir, float tmax);
+// bvh_closest_hit finds the nearest triangle along a ray, bvh_any_hit stops at the first
+extern bool bvh_closest_hit(BVH* bvh, Ray* ray, Hit* hit);
+extern bool bvh_any_hit(BVH* bvh, Ray* ray);
+// bench_bvh reports build time and ray throughput for a Model
+extern int bench_bvh(Model* model, int ray_count);
+
+// Defined in: chunks.c
+// preprocess_obj streams an OBJ into a chunk file without holding the model in memory
+extern int preprocess_obj(char* obj_filename, char* chunk_filename, size_t mem_cap);
+// open_chunked reads a chunk file's table, chunk data is paged in later
+extern ChunkedModel* open_chunked(char* filename, size_t budget);
+// page_chunks pages in visible chunks and evicts others to stay within the budget
+extern void page_chunks(Scene* scene, ChunkedModel* cm);
+extern void render_chunks(ChunkedModel* cm);
+extern void print_chunk_stats(ChunkedModel* cm);
+
+// Defined in: meshlets.c
+// build_meshlets splits a Model into clusters with bounding spheres and normal cones
+extern Meshlets* build_meshlets(Model* model);
+extern void free_meshlets(Meshlets* meshlets);
+extern size_t meshlet_bytes(Meshlets* meshlets);
+// cull_meshlets fills meshlets->visible with clusters that may be seen this frame
+extern int cull_meshlets(Scene* scene, Meshlets* meshlets);
+extern void print_meshlet_stats(Meshlets* meshlets);
+// bench_meshlets reports culling rates over a sweep of camera angles
+extern int bench_meshlets(Model* model, float scale);
+
+// Defined in: thumbnails.c
+// render_thumbnail rasterizes a Model on the CPU with the same lighting and projection as
+// render_scene. texture may be NULL.
+extern void render_thumbnail(Model* model, Image* texture, float scale,
+                             float xRot, float yRot, Image* out, float* depth);
+// render_batch renders thumbnails for every "model.obj texture.tga [scale]" line in a file,
+// writing the assets' load profiles as JSON to profile_out unless it is NULL
+extern int render_batch(char* list_filename, char* out_dir, int size, int angles, int threads,
+                        FILE* profile_out);
+
+// Defined in: profile.c
+// Loaders fill in a LoadProfile, then register it against the object they return.
+// init_profile starts measuring peak RSS, finish_profile stops. register_profile finishes
+// the profile itself, so only loads that fail or aren't registered call finish_profile.
+extern void init_profile(LoadProfile* profile, const char* kind, const char* name);
+extern void finish_profile(LoadProfile* profile);
+extern void profile_phase(LoadProfile* profile, LoadPhase phase, double start);
+extern void profile_bytes(LoadProfile* profile, MemCategory category, size_t bytes);
+extern void register_profile(LoadProfile* profile, void* owner);
+extern void unregister_profile(void* owner);
+// get_profile copies out the profile of a Model, Texture or ChunkedModel, add_to_profile
+// adds time and bytes spent on the object after it was loaded. Both return ERR if the
+// object has no profile.
+extern int get_profile(void* owner, LoadProfile* out);
+extern int add_to_profile(void* owner, LoadPhase phase, double seconds, MemCategory category, size_t bytes);
+extern size_t profile_total(LoadProfile* profile);
+// scene_profile sums the profiles of everything in a Scene
+extern void scene_profile(Scene* scene, LoadProfile* total);
+// dump_profile_json writes a Scene's total and every registered profile as JSON,
+// dump_profiles_json the total of a list of profiles and the list itself
+extern int dump_profile_json(Scene* scene, FILE* out);
+extern int dump_profiles_json(LoadProfile* profiles, int count, FILE* out);
+// peak_rss returns the peak resident set size in bytes since the last load started (or of
+// the whole process where that can't be reset), current_rss the resident set right now (0
+// where unavailable)
+extern long peak_rss(void);
+extern long current_rss(void);
 
 /* 
  * Structure Definitions
@@ -104,6 +289,14 @@ struct triangle
     Vector3f* n3;
 };
 
+// An image held in memory: 24 bit BGR pixels, rows from the bottom up like OpenGL.
+// Used where there is no OpenGL context to hand a texture to.
+struct image
+{
+	int width, height;
+	unsigned char* pixels;
+};
+
 // A texture holds its width and height, bit depth, and an array of pixels
 /*
 	struct texture
@@ -115,7 +308,84 @@ struct triangle
 // In a real program we'd use this as an interface but for here we'll just use an OpenGL
 // texture ID.
 
+// A ray with its inverse direction cached for slab tests against bounding boxes
+struct ray
+{
+	Vector3f origin;
+	Vector3f dir;
+	Vector3f inv_dir;
+	float tmin, tmax;
+};
+
+// Result of a ray query: which triangle was hit, where along the ray, and barycentrics
+struct hit
+{
+	int tri_index; // index into model->triangles
+	float t;
+	float u, v;
+};
+
+// A wide BVH node. Bounds are stored per axis (structure of arrays) so all children can
+// be tested against a ray at once.
+struct bvh_node
+{
+	float min_x[BVH_WIDTH], min_y[BVH_WIDTH], min_z[BVH_WIDTH];
+	float max_x[BVH_WIDTH], max_y[BVH_WIDTH], max_z[BVH_WIDTH];
+
+	// count == 0: child is an inner node index
+	// count  > 0: child is a leaf, the first of count triangles in the BVH's arrays
+	// count == -1: empty slot
+	int child[BVH_WIDTH];
+	int count[BVH_WIDTH];
+};
+
+// Bounding volume hierarchy over a Model's triangles
+struct bvh
+{
+	int node_count;
+	BVH_Node* nodes;
+
+	// Triangles in leaf order: the original triangle index and the first vertex plus two
+	// edge vectors (9 floats) for ray/triangle tests without chasing Triangle pointers.
+	int tri_count;
+	int* tri_index;
+	float* tri_data;
+
+	Vector3f bounds_min, bounds_max;
+	double build_time; // seconds
+	int build_threads; // threads that took part in the build, including the caller
+};
+
+// Clusters of up to MESHLET_MAX_TRIS triangles touching up to MESHLET_MAX_VERTS vertices.
+// Culling data is stored per field (structure of arrays), padded to a multiple of 4.
+struct meshlets
+{
+	int count, capacity;
+
+	// Meshlet i draws model->triangles[tris[tri_offset[i] .. tri_offset[i]+tri_count[i]-1]]
+	int tri_count_total;
+	int* tris;
+	int* tri_offset;
+	int* tri_count;
+
+	// Bounding spheres
+	float *center_x, *center_y, *center_z, *radius;
+
+	// Normal cones. Back facing when dot(axis, view direction) > cone_cutoff.
+	float *axis_x, *axis_y, *axis_z, *cone_cutoff;
+
+	// Results of the last cull_meshlets
+	int* visible;
+	int visible_count;
+	int backface_culled, frustum_culled;
+	int tris_submitted;
+
+	double build_time; // seconds
+};
+
 // Models consist of the number of triangles, an array of triangle pointers, and a texture.
+// The BVH and meshlets are built after loading, the BVH for picking and ray casting and
+// the meshlets for culling.
 struct model
 {
 	int tri_count;
@@ -123,6 +393,61 @@ struct model
 
 	Triangle** triangles;
 	Texture* texture;
+
+	// Attributes shared between triangles, kept so they can be freed
+	int vertex_count, uv_count, normal_count;
+	Vector3f** vertices;
+	Vector2f** uvs;
+	Vector3f** normals;
+
+	BVH* bvh;
+	Meshlets* meshlets;
+};
+
+// Memory use and load timings of one asset (or a whole Scene)
+struct load_profile
+{
+	const char* kind; // "model", "texture", "chunked" or "scene"
+	char name[PROFILE_NAME_SIZE];
+	void* owner;
+
+	size_t bytes[MEM_CATEGORY_COUNT];
+	double phase_time[PHASE_COUNT]; // seconds
+	long start_rss; // bytes, resident when the load started
+	long peak_rss; // bytes, highest resident set while the load ran
+	bool peak_is_process; // the platform can't reset the peak, so peak_rss is the process's
+	bool measuring; // between init_profile and finish_profile
+};
+
+// A spatial piece of an out-of-core model. data is NULL unless the chunk is resident.
+struct chunk
+{
+	Vector3f bounds_min, bounds_max;
+	int tri_count;
+	long long offset; // of the triangle data in the chunk file
+
+	float* data; // interleaved T2F_N3F_V3F vertices
+	long last_used, last_visible; // frame numbers
+};
+
+// A model too big for memory, rendered from whichever chunks are resident
+struct chunked_model
+{
+	FILE* file;
+	int chunk_count;
+	Chunk* chunks;
+
+	bool textured;
+	Texture* texture;
+
+	size_t budget;
+	size_t resident_bytes;
+	int resident_count;
+	long frame;
+
+	// Paging statistics
+	long page_ins, evictions, skipped;
+	double page_in_time, page_in_max; // seconds
 };
 
 // Scenes consist of a camera and some models for this demo
@@ -131,6 +456,8 @@ struct scene
 	float view_area_scale; // Should be a struct
     int model_count;
     Model** models;
+    ChunkedModel* chunked; // out-of-core model, NULL if none
+    Texture* texture; // as loaded, even if no model ended up using it
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,381 @@
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <pthread.h>
+
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+#include <GLFW/glfw3.h>
+
+#include "objtest.h"
+
+/*
+ * Memory accounting and load profiling.
+ *
+ * Loaders fill in a LoadProfile as they go and register it against the object they return
+ * (a Model, Texture or ChunkedModel). Profiles can then be looked up by object, summed for
+ * a Scene, or dumped as JSON.
+ *
+ * Byte counts are what the program asked for, not including allocator overhead. Chunked
+ * models are counted live since their resident set changes as chunks are paged.
+ *
+ * Peak RSS is measured per load on Linux by resetting the kernel's high-water mark when a
+ * load starts and reading it when the load finishes. Loads that overlap (batch rendering)
+ * share one measurement window, so their peaks include each other. Elsewhere the mark can't
+ * be reset and the peak is the process's so far, which peak_is_process records.
+ */
+
+/* Magic Numbers */
+#define REGISTRY_GROWTH 16
+#define STATUS_LINE_SIZE 256
+#define CLEAR_REFS_RESET_PEAK "5" // resets VmHWM, see proc(5)
+
+// Names used in the JSON output, in enum order
+static const char* category_names[MEM_CATEGORY_COUNT] =
+{ "positions", "uvs", "normals", "indices", "texture_levels", "bvh", "bookkeeping" };
+static const char* phase_names[PHASE_COUNT] =
+{ "io", "tokenize", "parse", "build", "upload" };
+
+// Every registered profile. Batch rendering loads assets on several threads at once, so
+// changes to the registry are locked.
+static LoadProfile* registry = NULL;
+static int registry_count = 0, registry_size = 0;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Loads between init_profile and finish_profile. Also guarded by registry_lock.
+static int loads_in_flight = 0;
+static bool peak_resettable = TRUE;
+
+// Reads a "Key:  1234 kB" line of /proc/self/status in bytes, 0 if unavailable
+static long read_status(const char* key)
+{
+    FILE* status = fopen("/proc/self/status", "r");
+    char line[STATUS_LINE_SIZE];
+    size_t key_length = strlen(key);
+    long kb = 0;
+
+    if (!status) { return 0; }
+
+    while (fgets(line, sizeof(line), status))
+    {
+        if (strncmp(line, key, key_length) == STR_EQUAL && line[key_length] == ':')
+        { sscanf(line + key_length + 1, "%ld", &kb); break; }
+    }
+
+    fclose(status);
+    return kb * 1024L;
+}
+
+// Sets the peak RSS back to the current RSS, returns FALSE if the platform can't
+static bool reset_peak_rss(void)
+{
+    FILE* clear_refs = fopen("/proc/self/clear_refs", "w");
+    bool reset = FALSE;
+
+    if (!clear_refs) { return FALSE; }
+    reset = fputs(CLEAR_REFS_RESET_PEAK, clear_refs) >= 0;
+    if (fclose(clear_refs) != 0) { reset = FALSE; }
+
+    return reset;
+}
+
+// Zeroes a profile without starting a measurement
+static void clear_profile(LoadProfile* profile, const char* kind, const char* name)
+{
+    memset(profile, 0, sizeof(LoadProfile));
+    profile->kind = kind;
+    strncpy(profile->name, name, PROFILE_NAME_SIZE-1);
+}
+
+void init_profile(LoadProfile* profile, const char* kind, const char* name)
+{
+    clear_profile(profile, kind, name);
+
+    pthread_mutex_lock(&registry_lock);
+
+    // Only start a new measurement window when it can't cut short another load's
+    if (loads_in_flight == 0 && peak_resettable) { peak_resettable = reset_peak_rss(); }
+    loads_in_flight++;
+
+    profile->measuring = TRUE;
+    profile->peak_is_process = !peak_resettable;
+    profile->start_rss = current_rss();
+
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void finish_profile(LoadProfile* profile)
+{
+    if (!profile->measuring) { return; }
+
+    pthread_mutex_lock(&registry_lock);
+    profile->peak_rss = peak_rss();
+    profile->measuring = FALSE;
+    loads_in_flight--;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void profile_phase(LoadProfile* profile, LoadPhase phase, double start)
+{
+    profile->phase_time[phase] += get_time() - start;
+}
+
+void profile_bytes(LoadProfile* profile, MemCategory category, size_t bytes)
+{
+    profile->bytes[category] += bytes;
+}
+
+size_t profile_total(LoadProfile* profile)
+{
+    size_t total = 0;
+    for (int c = 0; c < MEM_CATEGORY_COUNT; c++) { total += profile->bytes[c]; }
+    return total;
+}
+
+long current_rss(void)
+{
+    return read_status("VmRSS");
+}
+
+long peak_rss(void)
+{
+    struct rusage usage;
+    long peak = read_status("VmHWM");
+
+    // Without /proc, fall back to the process's peak
+    if (peak > 0) { return peak; }
+    if (getrusage(RUSAGE_SELF, &usage) != 0) { return 0; }
+
+#ifdef __APPLE__
+    return usage.ru_maxrss; // bytes
+#else
+    return usage.ru_maxrss * 1024L; // kilobytes
+#endif
+}
+
+void register_profile(LoadProfile* profile, void* owner)
+{
+    finish_profile(profile);
+
+    pthread_mutex_lock(&registry_lock);
+
+    if (registry_count == registry_size)
+    {
+        registry_size += REGISTRY_GROWTH;
+        registry = (LoadProfile*) realloc(registry, registry_size*sizeof(LoadProfile));
+    }
+
+    profile->owner = owner;
+    registry[registry_count++] = *profile;
+
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void unregister_profile(void* owner)
+{
+    pthread_mutex_lock(&registry_lock);
+
+    // Keep the rest in load order
+    for (int i = 0; i < registry_count; i++)
+    {
+        if (registry[i].owner != owner) { continue; }
+
+        memmove(&registry[i], &registry[i+1], (registry_count-i-1)*sizeof(LoadProfile));
+        registry_count--;
+        break;
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+}
+
+// Index of owner's profile in the registry, or ERR. The caller holds registry_lock.
+static int find_profile(void* owner)
+{
+    if (!owner) { return ERR; }
+
+    for (int i = 0; i < registry_count; i++) { if (registry[i].owner == owner) { return i; } }
+    return ERR;
+}
+
+int get_profile(void* owner, LoadProfile* out)
+{
+    int index = ERR;
+
+    // Copied out since registering and unregistering move the registry's entries
+    pthread_mutex_lock(&registry_lock);
+    index = find_profile(owner);
+    if (index >= 0) { *out = registry[index]; }
+    pthread_mutex_unlock(&registry_lock);
+
+    return index >= 0 ? NOERR : ERR;
+}
+
+int add_to_profile(void* owner, LoadPhase phase, double seconds, MemCategory category, size_t bytes)
+{
+    int index = ERR;
+
+    pthread_mutex_lock(&registry_lock);
+    index = find_profile(owner);
+    if (index >= 0)
+    {
+        registry[index].phase_time[phase] += seconds;
+        registry[index].bytes[category] += bytes;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    return index >= 0 ? NOERR : ERR;
+}
+
+// Refreshes a chunked model's profile with its current resident set
+static void update_chunked_profile(ChunkedModel* cm)
+{
+    pthread_mutex_lock(&registry_lock);
+
+    int index = find_profile(cm);
+    if (index >= 0)
+    {
+        // Resident chunks are interleaved T2F_N3F_V3F vertices
+        registry[index].bytes[MEM_UVS] = cm->resident_bytes * 2/8;
+        registry[index].bytes[MEM_NORMALS] = cm->resident_bytes * 3/8;
+        registry[index].bytes[MEM_POSITIONS] = cm->resident_bytes * 3/8;
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+}
+
+// Adds one profile's bytes and times to a running total
+static void add_profile(LoadProfile* total, LoadProfile* profile)
+{
+    for (int c = 0; c < MEM_CATEGORY_COUNT; c++) { total->bytes[c] += profile->bytes[c]; }
+    for (int p = 0; p < PHASE_COUNT; p++) { total->phase_time[p] += profile->phase_time[p]; }
+    if (profile->peak_rss > total->peak_rss) { total->peak_rss = profile->peak_rss; }
+    if (profile->peak_is_process) { total->peak_is_process = TRUE; }
+}
+
+// Adds the profile registered for owner, if there is one, to a running total
+static void add_owner_profile(LoadProfile* total, void* owner)
+{
+    LoadProfile profile;
+    if (get_profile(owner, &profile) == NOERR) { add_profile(total, &profile); }
+}
+
+// Whether texture is used by one of the scene's first model_count models or its chunked model
+static bool texture_counted(Scene* scene, int model_count, Texture* texture)
+{
+    for (int i = 0; i < model_count; i++) { if (scene->models[i]->texture == texture) { return TRUE; } }
+    return scene->chunked && scene->chunked->texture == texture;
+}
+
+void scene_profile(Scene* scene, LoadProfile* total)
+{
+    clear_profile(total, "scene", "scene");
+    total->start_rss = current_rss();
+
+    // The scene itself
+    profile_bytes(total, MEM_BOOKKEEPING, sizeof(Scene) + scene->model_count*sizeof(Model*));
+
+    if (scene->chunked)
+    {
+        update_chunked_profile(scene->chunked);
+        add_owner_profile(total, scene->chunked);
+        add_owner_profile(total, scene->chunked->texture);
+    }
+
+    // A texture shared with an earlier model or the chunked model is only counted once
+    for (int i = 0; i < scene->model_count; i++)
+    {
+        add_owner_profile(total, scene->models[i]);
+        if (!texture_counted(scene, i, scene->models[i]->texture))
+        { add_owner_profile(total, scene->models[i]->texture); }
+    }
+
+    // The loaded texture still takes memory when no model uses it
+    if (!texture_counted(scene, scene->model_count, scene->texture))
+    { add_owner_profile(total, scene->texture); }
+
+    // Includes whatever ran after the last load, such as BVH builds
+    if (peak_rss() > total->peak_rss) { total->peak_rss = peak_rss(); }
+}
+
+// Writes a string with JSON escaping
+static void write_json_string(FILE* out, const char* s)
+{
+    fputc('"', out);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\') { fprintf(out, "\\%c", *s); }
+        else if ((unsigned char) *s < 0x20) { fprintf(out, "\\u%04x", *s); }
+        else { fputc(*s, out); }
+    }
+    fputc('"', out);
+}
+
+// Writes the fields shared by assets and the scene total
+static void write_json_profile(FILE* out, LoadProfile* profile, const char* indent)
+{
+    fprintf(out, "%s\"kind\": ", indent);
+    write_json_string(out, profile->kind);
+    fprintf(out, ",\n%s\"name\": ", indent);
+    write_json_string(out, profile->name);
+
+    fprintf(out, ",\n%s\"bytes\": {", indent);
+    for (int c = 0; c < MEM_CATEGORY_COUNT; c++)
+    { fprintf(out, "%s\"%s\": %zu", c ? ", " : " ", category_names[c], profile->bytes[c]); }
+    fprintf(out, " },\n%s\"total_bytes\": %zu,\n", indent, profile_total(profile));
+
+    fprintf(out, "%s\"timings_ms\": {", indent);
+    for (int p = 0; p < PHASE_COUNT; p++)
+    { fprintf(out, "%s\"%s\": %.3f", p ? ", " : " ", phase_names[p], profile->phase_time[p]*1000.0); }
+    fprintf(out, " },\n%s\"start_rss_bytes\": %ld,\n", indent, profile->start_rss);
+    fprintf(out, "%s\"peak_rss_bytes\": %ld,\n", indent, profile->peak_rss);
+    fprintf(out, "%s\"peak_rss_scope\": \"%s\"", indent, profile->peak_is_process ? "process" : "load");
+}
+
+// Writes a total under key, followed by a list of assets
+static int write_json(FILE* out, const char* key, LoadProfile* total, LoadProfile* assets, int count)
+{
+    fprintf(out, "{\n  \"%s\": {\n", key);
+    write_json_profile(out, total, "    ");
+    fprintf(out, "\n  },\n  \"assets\": [");
+
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(out, "%s\n    {\n", i ? "," : "");
+        write_json_profile(out, &assets[i], "      ");
+        fprintf(out, "\n    }");
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+
+    return ferror(out) ? ERR : NOERR;
+}
+
+int dump_profile_json(Scene* scene, FILE* out)
+{
+    LoadProfile total;
+    int ret = NOERR;
+
+    scene_profile(scene, &total);
+
+    // Every registered asset, including ones loaded outside this scene
+    pthread_mutex_lock(&registry_lock);
+    ret = write_json(out, "scene", &total, registry, registry_count);
+    pthread_mutex_unlock(&registry_lock);
+
+    return ret;
+}
+
+int dump_profiles_json(LoadProfile* profiles, int count, FILE* out)
+{
+    LoadProfile total;
+
+    clear_profile(&total, "batch", "batch");
+    for (int i = 0; i < count; i++) { add_profile(&total, &profiles[i]); }
+
+    return write_json(out, "batch", &total, profiles, count);
+}
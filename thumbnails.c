@@ -0,0 +1,516 @@
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+#include <GLFW/glfw3.h>
+
+#include "objtest.h"
+
+/*
+ * Headless thumbnail rendering.
+ *
+ * render_thumbnail is a small software rasterizer that draws a Model the way render_scene
+ * would with the state set up by init_scene: the same orthographic projection and camera
+ * rotation, per vertex lighting from LIGHT0 with OpenGL's default material, back face
+ * culling, depth testing and nearest filtered texturing (modulated by the lighting).
+ *
+ * render_batch hands assets out to worker threads, each of which loads an asset and renders
+ * it from several angles. Nothing here touches OpenGL, so it runs on machines without a GPU.
+ */
+
+/* Magic Numbers */
+// OpenGL's defaults for what init_scene leaves unset. The default material has no
+// specular reflection, so LIGHT_SPECULAR never contributes.
+#define SCENE_AMBIENT 0.2f // GL_LIGHT_MODEL_AMBIENT
+#define MAT_AMBIENT 0.2f // GL_AMBIENT of the default material
+#define MAT_DIFFUSE 0.8f // GL_DIFFUSE of the default material
+#define BATCH_PATH_SIZE 1024
+
+// One line of the batch list
+typedef struct batch_asset
+{
+    char obj_file[BATCH_PATH_SIZE];
+    char tex_file[BATCH_PATH_SIZE]; // "-" for untextured
+    float scale;
+
+    char name[BATCH_PATH_SIZE]; // thumbnails are written as <name>_<angle>.tga
+    int line; // in the list file, for error messages
+    bool clash; // an earlier line lists the same OBJ and texture, so it isn't rendered
+} Batch_Asset;
+
+// State shared between batch workers
+typedef struct batch_state
+{
+    Batch_Asset* assets;
+    int asset_count;
+    int next_asset; // taken atomically by workers
+
+    char* out_dir;
+    int size, angles;
+
+    // Model and texture profile of each asset for --profile-json, kind is NULL if unused.
+    // Workers only touch their own assets' entries.
+    LoadProfile* profiles;
+
+    // Totals, summed over workers under the lock
+    pthread_mutex_t lock;
+    int thumbnails, failures;
+    double load_time, render_time, write_time; // seconds
+} Batch_State;
+
+// A vertex after lighting and projection
+typedef struct raster_vertex
+{
+    float x, y, z; // window x and y, normalized device depth
+    float color[3];
+    float u, v;
+} Raster_Vertex;
+
+// Fixed function per vertex lighting of a vertex in eye space
+static void light_vertex(Vector3f* p, Vector3f* n, float* color)
+{
+    float ambient[] = LIGHT_AMBIENT;
+    float diffuse[] = LIGHT_DIFFUSE;
+    float position[] = LIGHT_POSITION;
+
+    // Unit vector from the vertex to the positional light
+    float lx = position[0]-p->x, ly = position[1]-p->y, lz = position[2]-p->z;
+    float len = sqrtf(lx*lx + ly*ly + lz*lz);
+    if (len > 0) { lx /= len; ly /= len; lz /= len; }
+
+    // OpenGL uses the normal as given since GL_NORMALIZE is not enabled
+    float n_dot_l = fmaxf(0.0f, n->x*lx + n->y*ly + n->z*lz);
+
+    for (int c = 0; c < 3; c++)
+    {
+        color[c] = SCENE_AMBIENT*MAT_AMBIENT + ambient[c]*MAT_AMBIENT + n_dot_l*diffuse[c]*MAT_DIFFUSE;
+        if (color[c] > 1.0f) { color[c] = 1.0f; }
+    }
+}
+
+// Signed area test of point (px, py) against edge a->b
+static float edge(const Raster_Vertex* a, const Raster_Vertex* b, float px, float py)
+{
+    return (b->x - a->x)*(py - a->y) - (b->y - a->y)*(px - a->x);
+}
+
+static void draw_raster_triangle(Raster_Vertex* rv, Image* texture, Image* out, float* depth)
+{
+    int w = out->width, h = out->height;
+
+    // Counter clockwise is front facing, everything else is culled like GL_CULL_FACE
+    float area = edge(&rv[0], &rv[1], rv[2].x, rv[2].y);
+    if (area <= 0.0f) { return; }
+
+    int min_x = (int) floorf(fminf(rv[0].x, fminf(rv[1].x, rv[2].x)));
+    int max_x = (int) ceilf(fmaxf(rv[0].x, fmaxf(rv[1].x, rv[2].x)));
+    int min_y = (int) floorf(fminf(rv[0].y, fminf(rv[1].y, rv[2].y)));
+    int max_y = (int) ceilf(fmaxf(rv[0].y, fmaxf(rv[1].y, rv[2].y)));
+
+    if (min_x < 0) { min_x = 0; }
+    if (min_y < 0) { min_y = 0; }
+    if (max_x > w-1) { max_x = w-1; }
+    if (max_y > h-1) { max_y = h-1; }
+
+    for (int y = min_y; y <= max_y; y++)
+    {
+        for (int x = min_x; x <= max_x; x++)
+        {
+            // Sample at the pixel center
+            float px = x + 0.5f, py = y + 0.5f;
+            float b0 = edge(&rv[1], &rv[2], px, py);
+            float b1 = edge(&rv[2], &rv[0], px, py);
+            float b2 = edge(&rv[0], &rv[1], px, py);
+            if (b0 < 0 || b1 < 0 || b2 < 0) { continue; }
+
+            b0 /= area; b1 /= area; b2 /= area;
+
+            // Clip against the near and far planes, then depth test with GL_LESS
+            float z = b0*rv[0].z + b1*rv[1].z + b2*rv[2].z;
+            if (z < -1.0f || z > 1.0f || z >= depth[y*w+x]) { continue; }
+            depth[y*w+x] = z;
+
+            float color[3];
+            for (int c = 0; c < 3; c++)
+            { color[c] = b0*rv[0].color[c] + b1*rv[1].color[c] + b2*rv[2].color[c]; }
+
+            // GL_MODULATE with GL_REPEAT wrapping and nearest filtering. Images are BGR.
+            unsigned char* pixel = &out->pixels[(y*w+x)*3];
+            if (texture)
+            {
+                float s = b0*rv[0].u + b1*rv[1].u + b2*rv[2].u;
+                float t = b0*rv[0].v + b1*rv[1].v + b2*rv[2].v;
+                int tx = (int) ((s - floorf(s)) * texture->width);
+                int ty = (int) ((t - floorf(t)) * texture->height);
+                if (tx >= texture->width) { tx = texture->width-1; }
+                if (ty >= texture->height) { ty = texture->height-1; }
+
+                unsigned char* texel = &texture->pixels[(ty*texture->width+tx)*3];
+                pixel[0] = (unsigned char) (color[2]*texel[0] + 0.5f);
+                pixel[1] = (unsigned char) (color[1]*texel[1] + 0.5f);
+                pixel[2] = (unsigned char) (color[0]*texel[2] + 0.5f);
+            }
+            else
+            {
+                pixel[0] = (unsigned char) (color[2]*255.0f + 0.5f);
+                pixel[1] = (unsigned char) (color[1]*255.0f + 0.5f);
+                pixel[2] = (unsigned char) (color[0]*255.0f + 0.5f);
+            }
+        }
+    }
+}
+
+void render_thumbnail(Model* model, Image* texture, float scale,
+                      float xRot, float yRot, Image* out, float* depth)
+{
+    float half_w, half_h;
+    int w = out->width, h = out->height;
+
+    // Clear to black and the far plane
+    memset(out->pixels, 0, w*h*3);
+    for (int i = 0; i < w*h; i++) { depth[i] = 1.0f; }
+
+    view_extents(scale, w, h, &half_w, &half_h);
+    if (!model->textured) { texture = NULL; }
+
+    for (int i = 0; i < model->tri_count; i++)
+    {
+        Triangle* t = model->triangles[i];
+        Vector3f* p[3] = { t->v1, t->v2, t->v3 };
+        Vector3f* n[3] = { t->n1, t->n2, t->n3 };
+        Vector2f* u[3] = { t->u1, t->u2, t->u3 };
+        Raster_Vertex rv[3];
+
+        for (int k = 0; k < 3; k++)
+        {
+            Vector3f eye = *p[k];
+            Vector3f normal = *n[k];
+
+            rotate_to_eye(&eye, xRot, yRot);
+            rotate_to_eye(&normal, xRot, yRot);
+            light_vertex(&eye, &normal, rv[k].color);
+
+            // Same projection as render_scene's glOrtho, mapped to window coordinates
+            rv[k].x = (eye.x/half_w + 1.0f) * 0.5f * w;
+            rv[k].y = (eye.y/half_h + 1.0f) * 0.5f * h;
+            rv[k].z = -eye.z / scale;
+
+            // UV pointers are only valid for textured models
+            rv[k].u = texture ? u[k]->x : 0.0f;
+            rv[k].v = texture ? u[k]->y : 0.0f;
+        }
+
+        draw_raster_triangle(rv, texture, out, depth);
+    }
+}
+
+// Thumbnail name of an asset: its OBJ path without the extension, with directories joined
+// by '_', then the texture's file name without the extension (chairs/oak/model.obj with
+// wood.tga becomes chairs_oak_model_wood). Assets sharing a file name in different folders,
+// or the same OBJ with different textures, get different thumbnails.
+static void thumbnail_name(char* name, const char* obj_file, const char* tex_file)
+{
+    const char* stem = strrchr(tex_file, '/');
+    char* dot = NULL;
+    char* slash = NULL;
+    size_t length = 0;
+
+    // Leading "/" and "./" say nothing about the asset
+    while (*obj_file == '/' || strncmp(obj_file, "./", 2) == STR_EQUAL)
+    { obj_file += *obj_file == '/' ? 1 : 2; }
+
+    snprintf(name, BATCH_PATH_SIZE, "%s", obj_file);
+
+    // Drop the extension, but not a dot in a directory name
+    dot = strrchr(name, '.');
+    slash = strrchr(name, '/');
+    if (dot && (!slash || dot > slash)) { *dot = '\0'; }
+
+    for (char* c = name; *c; c++) { if (*c == '/') { *c = '_'; } }
+
+    if (strcmp(tex_file, "-") == STR_EQUAL) { return; }
+
+    length = strlen(name);
+    snprintf(name + length, BATCH_PATH_SIZE - length, "_%s", stem ? stem+1 : tex_file);
+    dot = strrchr(name + length, '.');
+    if (dot) { *dot = '\0'; }
+}
+
+// FNV-1a hash of an asset's OBJ and texture paths, to tell apart assets whose names match
+static unsigned int asset_hash(const Batch_Asset* asset)
+{
+    unsigned int hash = 2166136261u;
+
+    for (const char* c = asset->obj_file; *c; c++) { hash = (hash ^ (unsigned char) *c) * 16777619u; }
+    hash = (hash ^ '\n') * 16777619u;
+    for (const char* c = asset->tex_file; *c; c++) { hash = (hash ^ (unsigned char) *c) * 16777619u; }
+
+    return hash;
+}
+
+// qsort comparator ordering assets by thumbnail name, then by list order
+static int compare_names(const void* a, const void* b)
+{
+    const Batch_Asset* x = *(const Batch_Asset**) a;
+    const Batch_Asset* y = *(const Batch_Asset**) b;
+    int order = strcmp(x->name, y->name);
+
+    if (order != STR_EQUAL) { return order; }
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+// Output path for one angle of an asset: <out_dir>/<name>_<angle>.tga. Returns ERR rather
+// than a shortened path if it doesn't fit.
+static int thumbnail_path(char* path, char* out_dir, char* name, int angle)
+{
+    int length = snprintf(path, BATCH_PATH_SIZE, "%s/%s_%02d.tga", out_dir, name, angle);
+
+    if (length < 0 || length >= BATCH_PATH_SIZE)
+    { fprintf(stderr, "Thumbnail path for %s in %s is too long.\n", name, out_dir); return ERR; }
+
+    return NOERR;
+}
+
+static void* batch_worker(void* arg)
+{
+    Batch_State* state = (Batch_State*) arg;
+    int size = state->size;
+    Image out;
+    float* depth = (float*) calloc(size*size, sizeof(float));
+    int thumbnails = 0, failures = 0;
+    double load_time = 0, render_time = 0, write_time = 0;
+
+    out.width = out.height = size;
+    out.pixels = (unsigned char*) calloc(size*size*3, sizeof(unsigned char));
+    if (!depth || !out.pixels) { fprintf(stderr, "Out of memory for thumbnails.\n"); return NULL; }
+
+    for (;;)
+    {
+        int index = __sync_fetch_and_add(&state->next_asset, 1);
+        if (index >= state->asset_count) { break; }
+
+        Batch_Asset* asset = &state->assets[index];
+        Image* texture = NULL;
+        LoadProfile profile;
+
+        if (asset->clash) { continue; } // already counted as a failure
+
+        /* Load */
+
+        double start = get_time();
+        Model* model = load_obj(asset->obj_file);
+
+        init_profile(&profile, "texture", asset->tex_file);
+        if (model && strcmp(asset->tex_file, "-") != STR_EQUAL)
+        { texture = read_tga(asset->tex_file, &profile); }
+        finish_profile(&profile);
+
+        // The pixels are what load_tex would upload, so count them the same way
+        if (texture)
+        {
+            profile_bytes(&profile, MEM_TEXTURE_LEVELS, texture->width*texture->height*3);
+            profile_bytes(&profile, MEM_BOOKKEEPING, sizeof(Image));
+        }
+        load_time += get_time() - start;
+
+        if (!model)
+        { fprintf(stderr, "Could not load model %s\n", asset->obj_file); failures++; continue; }
+        if (state->profiles)
+        {
+            get_profile(model, &state->profiles[index*2]);
+            if (texture) { state->profiles[index*2+1] = profile; }
+        }
+        if (model->textured && !texture)
+        { fprintf(stderr, "WARNING: Rendering %s without a texture.\n", asset->obj_file); }
+
+        /* Render each angle */
+
+        for (int a = 0; a < state->angles; a++)
+        {
+            char path[BATCH_PATH_SIZE];
+            float xRot = a * 360.0f / state->angles;
+
+            start = get_time();
+            render_thumbnail(model, texture, asset->scale, xRot, DEF_THUMB_PITCH, &out, depth);
+            render_time += get_time() - start;
+
+            start = get_time();
+            if (thumbnail_path(path, state->out_dir, asset->name, a) < NOERR ||
+                write_tga(path, &out) < NOERR) { failures++; }
+            else { thumbnails++; }
+            write_time += get_time() - start;
+        }
+
+        /* Garbage Collection */
+
+        free_image(texture); texture = NULL;
+        free_model(model); model = NULL;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    state->thumbnails += thumbnails;
+    state->failures += failures;
+    state->load_time += load_time;
+    state->render_time += render_time;
+    state->write_time += write_time;
+    pthread_mutex_unlock(&state->lock);
+
+    free(out.pixels); out.pixels = NULL;
+    free(depth); depth = NULL;
+
+    return NULL;
+}
+
+int render_batch(char* list_filename, char* out_dir, int size, int angles, int threads,
+                 FILE* profile_out)
+{
+    /* Variables */
+
+    FILE* list_file = fopen(list_filename, "r");
+    char line[BATCH_PATH_SIZE*2 + 64];
+    int line_number = 0, asset_size = 0;
+    Batch_Asset** by_name = NULL;
+    pthread_t* workers = NULL;
+    Batch_State state;
+    double start = 0, elapsed = 0;
+
+    memset(&state, 0, sizeof(Batch_State));
+
+    // error checking
+    if (!list_file) { fprintf(stderr, "Could not open %s\n", list_filename); return ERR; }
+    if (size <= 0 || angles <= 0)
+    { fprintf(stderr, "Thumbnail size and angle count must be positive.\n"); return ERR; }
+    if (threads < 1) { threads = 1; }
+
+    /* Reading the asset list */
+
+    while (fgets(line, sizeof(line), list_file))
+    {
+        Batch_Asset asset;
+        char format[32];
+
+        line_number++;
+
+        // Skip blank lines and comments
+        memset(&asset, 0, sizeof(Batch_Asset));
+        asset.scale = DEF_THUMB_SCALE;
+        asset.line = line_number;
+        snprintf(format, sizeof(format), "%%%ds %%%ds %%f", BATCH_PATH_SIZE-1, BATCH_PATH_SIZE-1);
+        if (line[0] == '#' || sscanf(line, format, asset.obj_file, asset.tex_file, &asset.scale) < 2)
+        { continue; }
+        thumbnail_name(asset.name, asset.obj_file, asset.tex_file);
+
+        if (state.asset_count == asset_size)
+        {
+            asset_size = asset_size ? asset_size*2 : 16;
+            state.assets = (Batch_Asset*) realloc(state.assets, asset_size*sizeof(Batch_Asset));
+        }
+        state.assets[state.asset_count++] = asset;
+    }
+    fclose(list_file); list_file = NULL;
+
+    if (state.asset_count == 0) { fprintf(stderr, "No assets listed in %s\n", list_filename); return ERR; }
+
+    /* Checking names */
+
+    // Assets sharing a name are either repeats of an earlier line, which are failed, or
+    // different OBJ and texture pairs that happen to map to the same name (a_b/c.obj and
+    // a/b_c.obj), which get a hash of the pair appended
+    by_name = (Batch_Asset**) calloc(state.asset_count, sizeof(Batch_Asset*));
+    for (int i = 0; i < state.asset_count; i++) { by_name[i] = &state.assets[i]; }
+    qsort(by_name, state.asset_count, sizeof(Batch_Asset*), compare_names);
+
+    for (int i = 1, group = 0; i < state.asset_count; i++)
+    {
+        Batch_Asset* asset = by_name[i];
+        Batch_Asset* repeated = NULL;
+
+        if (strcmp(asset->name, by_name[group]->name) != STR_EQUAL) { group = i; continue; }
+
+        for (int j = group; j < i && !repeated; j++)
+        {
+            if (strcmp(asset->obj_file, by_name[j]->obj_file) == STR_EQUAL &&
+                strcmp(asset->tex_file, by_name[j]->tex_file) == STR_EQUAL) { repeated = by_name[j]; }
+        }
+
+        if (repeated)
+        {
+            fprintf(stderr, "Line %d repeats %s %s from line %d, skipping it.\n",
+                    asset->line, asset->obj_file, asset->tex_file, repeated->line);
+            asset->clash = TRUE;
+            state.failures++;
+        }
+        else
+        {
+            size_t length = strlen(asset->name);
+            snprintf(asset->name + length, BATCH_PATH_SIZE - length, "_%08x", asset_hash(asset));
+        }
+    }
+    free(by_name); by_name = NULL;
+
+    /* Rendering */
+
+    state.out_dir = out_dir;
+    state.size = size;
+    state.angles = angles;
+    pthread_mutex_init(&state.lock, NULL);
+    if (profile_out) { state.profiles = (LoadProfile*) calloc(state.asset_count*2, sizeof(LoadProfile)); }
+
+    workers = (pthread_t*) calloc(threads, sizeof(pthread_t));
+    start = get_time();
+
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&workers[i], NULL, batch_worker, &state) != 0)
+        { fprintf(stderr, "Could not start worker %d.\n", i); threads = i; break; }
+    }
+    for (int i = 0; i < threads; i++) { pthread_join(workers[i], NULL); }
+
+    elapsed = get_time() - start;
+
+    // Stage times are summed over workers, so with several threads they add up to more
+    // than the wall clock time. Profile JSON sent to stdout moves the report to stderr.
+    FILE* report = profile_out == stdout ? stderr : stdout;
+    fprintf(report, "Rendered %d thumbnails of %d assets in %.2f s on %d threads: %.1f thumbnails/s\n",
+            state.thumbnails, state.asset_count, elapsed, threads,
+            elapsed > 0 ? state.thumbnails / elapsed : 0.0);
+    fprintf(report, "Stage time over all workers: load %.1f ms, render %.1f ms, write %.1f ms\n",
+            state.load_time*1000.0, state.render_time*1000.0, state.write_time*1000.0);
+    if (state.thumbnails > 0)
+    {
+        fprintf(report, "Per thumbnail: render %.2f ms, write %.2f ms\n",
+                state.render_time*1000.0 / state.thumbnails, state.write_time*1000.0 / state.thumbnails);
+    }
+    if (state.failures > 0) { fprintf(report, "%d failures\n", state.failures); }
+
+    /* Profiles */
+
+    if (state.profiles)
+    {
+        int profile_count = 0;
+
+        // Drop the entries of failed loads and untextured assets, keeping list order
+        for (int i = 0; i < state.asset_count*2; i++)
+        { if (state.profiles[i].kind) { state.profiles[profile_count++] = state.profiles[i]; } }
+
+        if (dump_profiles_json(state.profiles, profile_count, profile_out) < NOERR)
+        { fprintf(stderr, "Could not write profile.\n"); state.failures++; }
+    }
+
+    /* Garbage Collection */
+
+    pthread_mutex_destroy(&state.lock);
+    free(workers); workers = NULL;
+    free(state.assets); state.assets = NULL;
+    free(state.profiles); state.profiles = NULL;
+
+    return state.failures > 0 ? ERR : NOERR;
+}